@@ -0,0 +1,130 @@
+#include "./lib/sound_pr.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+
+// Throughput of one pass over a large file with buffered, direct and nocache I/O, how
+// much of the input and output stays in the page cache afterwards and how a process
+// reading its own cached file at the same time fares.
+// Run from the build directory: ./bench/io_bench [megabytes]
+
+static const u_int32_t sampleRate = 44100;
+
+static void writeInput(string fileName, u_int64_t bytes)
+{
+    const u_int64_t count = bytes / sizeof(int16_t);
+    WAVHeader header = {{'R', 'I', 'F', 'F'}, 0, {'W', 'A', 'V', 'E'}, {'f', 'm', 't', ' '}, 16, 1, 1,
+                        sampleRate, sampleRate * 2, 2, 16, {'d', 'a', 't', 'a'}, 0};
+    header.subchunk2Size = count * sizeof(int16_t);
+    header.chunkSize = sizeof(WAVHeader) - 8 + header.subchunk2Size;
+
+    ofstream fout(fileName, ios::binary | ios::trunc);
+    fout.write((const char *)&header, sizeof(WAVHeader));
+
+    vector<int16_t> block(sampleRate);
+    for (u_int64_t pos = 0; pos < count; pos += block.size())
+    {
+        for (size_t i = 0; i < block.size(); ++i)
+            block[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * (pos + i) / sampleRate));
+        fout.write((const char *)block.data(), min((u_int64_t)block.size(), count - pos) * sizeof(int16_t));
+    }
+}
+
+static void dropCache(string fileName)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+static double residentMB(string fileName)
+{
+    // Pages of the file in the page cache, as mincore() sees them through a mapping
+    int fd = open(fileName.c_str(), O_RDONLY);
+    u_int64_t size = fs::file_size(fileName);
+    if (fd < 0 || size == 0)
+        return 0.0;
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    const long page = sysconf(_SC_PAGESIZE);
+    vector<unsigned char> pages((size + page - 1) / page);
+    mincore(map, size, pages.data());
+    munmap(map, size);
+    close(fd);
+
+    u_int64_t resident = 0;
+    for (unsigned char flags : pages)
+        resident += flags & 1;
+    return resident * page / 1048576.0;
+}
+
+int main(int argc, char **argv)
+{
+    const u_int64_t megabytes = argc > 1 ? stoull(argv[1]) : 1024;
+    const fs::path dir = fs::current_path() / ("io_bench." + to_string(getpid()));
+    fs::create_directories(dir);
+
+    const string input = dir / "in.wav", output = dir / "out.wav", hot = dir / "hot.bin";
+    writeInput(input, megabytes << 20);
+
+    // The co-running process works on a file of its own that it keeps cached
+    const u_int64_t hotBytes = 256 << 20;
+    {
+        ofstream fout(hot, ios::binary | ios::trunc);
+        vector<char> block(1 << 20, 1);
+        for (u_int64_t i = 0; i < hotBytes; i += block.size())
+            fout.write(block.data(), block.size());
+    }
+
+    cout << "one pass over " << megabytes << " MB" << endl;
+    for (auto [name, mode] : vector<pair<string, IOMode>>{
+             {"buffered", IOMode::Buffered}, {"direct", IOMode::Direct}, {"nocache", IOMode::NoCache}})
+    {
+        dropCache(input);
+        dropCache(output);
+
+        // Warm the co-runner's file, then let it read it over and over during the pass
+        atomic<bool> stop{false};
+        atomic<u_int64_t> hotRead{0};
+        vector<char> scratch(1 << 20);
+        int hotFd = open(hot.c_str(), O_RDONLY);
+        for (u_int64_t off = 0; off < hotBytes; off += scratch.size())
+            pread(hotFd, scratch.data(), scratch.size(), off);
+
+        thread corunner([&]
+                        {
+            vector<char> buffer(1 << 20);
+            while (!stop)
+                for (u_int64_t off = 0; off < hotBytes && !stop; off += buffer.size())
+                    hotRead += pread(hotFd, buffer.data(), buffer.size(), off); });
+
+        ReadWAV reader;
+        WriteWAV writer;
+        reader.setIOMode(mode);
+        writer.setIOMode(mode);
+        Mute mute(0, 1);
+        StreamPass pass;
+        pass.add(&mute);
+
+        auto start = chrono::steady_clock::now();
+        pass.run(input, output, reader, writer);
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+        stop = true;
+        corunner.join();
+        close(hotFd);
+
+        ostringstream line;
+        line << fixed << setprecision(0) << left << setw(10) << name << right
+             << setw(8) << megabytes * 1000.0 / ms << " MB/s"
+             << "   cached in " << setw(6) << residentMB(input) << " MB, out " << setw(6) << residentMB(output)
+             << " MB, co-runner file " << setw(4) << residentMB(hot) << " MB"
+             << "   co-runner " << setw(6) << hotRead / 1048576.0 * 1000.0 / ms << " MB/s";
+        cout << line.str() << endl;
+
+        fs::remove(output);
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
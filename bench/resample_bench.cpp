@@ -0,0 +1,112 @@
+#include "./lib/sound_pr.hpp"
+
+// Speed and accuracy of the sample rate converter for every preset, converting to the
+// pipeline rate. Run from the build directory: ./bench/resample_bench [seconds]
+
+static const pair<const char *, ResampleQuality> presets[] = {
+    {"fast", ResampleQuality::Fast}, {"medium", ResampleQuality::Medium}, {"best", ResampleQuality::Best}};
+
+static vector<int16_t> convert(const vector<int16_t> &input, u_int32_t from, ResampleQuality quality)
+{
+    Resampler resampler(from, pipelineRate, quality);
+    vector<int16_t> output(resampler.outputLength(input.size()));
+    resampler.push(input.data(), input.size());
+    resampler.finish();
+    resampler.pull(output.data(), output.size());
+    return output;
+}
+
+static vector<int16_t> tone(double freq, u_int32_t rate, double seconds)
+{
+    vector<int16_t> samples((size_t)(seconds * rate));
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)lrint(16000 * sin(2 * M_PI * freq * i / rate));
+    return samples;
+}
+
+// Error of a converted tone against the exact one at the pipeline rate, in dB under the tone.
+// The first and last tenth are left out, the filter sees zeros there.
+static double toneError(double freq, u_int32_t from, ResampleQuality quality)
+{
+    const vector<int16_t> output = convert(tone(freq, from, 2), from, quality);
+    double signal = 0, error = 0;
+    for (size_t n = output.size() / 10; n < output.size() * 9 / 10; ++n)
+    {
+        const double exact = 16000 * sin(2 * M_PI * freq * n / pipelineRate);
+        signal += exact * exact;
+        error += (output[n] - exact) * (output[n] - exact);
+    }
+    return 10 * log10(error / signal);
+}
+
+// Level of a tone above the new Nyquist after the conversion, in dB under the tone
+static double stopbandLevel(double freq, u_int32_t from, ResampleQuality quality)
+{
+    const vector<int16_t> output = convert(tone(freq, from, 2), from, quality);
+    double energy = 0;
+    for (size_t n = output.size() / 10; n < output.size() * 9 / 10; ++n)
+        energy += (double)output[n] * output[n];
+    const double rms = sqrt(energy / (output.size() * 8 / 10));
+    return 20 * log10(max(rms, 1e-3) / (16000 / sqrt(2.0)));
+}
+
+int main(int argc, char **argv)
+{
+    const u_int32_t seconds = argc > 1 ? stoul(argv[1]) : 60;
+    const u_int32_t rates[] = {22050, 48000, 96000};
+
+    cout << "throughput, " << seconds << " s of audio" << endl;
+    for (u_int32_t from : rates)
+    {
+        vector<int16_t> input((size_t)seconds * from);
+        u_int32_t seed = 1;
+        for (int16_t &sample : input)
+        {
+            seed = seed * 1664525 + 1013904223;
+            sample = (int16_t)(seed >> 18) - 8192;
+        }
+
+        for (auto [name, quality] : presets)
+        {
+            // The way ReadWAV feeds it, a second of the file at a time
+            Resampler resampler(from, pipelineRate, quality);
+            vector<int16_t> block(pipelineRate);
+            auto start = chrono::steady_clock::now();
+            for (size_t first = 0; first < input.size(); first += from)
+            {
+                resampler.push(input.data() + first, min((size_t)from, input.size() - first));
+                while (resampler.pull(block.data(), block.size()) == block.size())
+                    ;
+            }
+            const double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+
+            ostringstream line;
+            line << setw(6) << from << " -> " << pipelineRate << "  " << left << setw(8) << name << right
+                 << fixed << setprecision(2) << setw(10) << ms << " ms" << setprecision(0) << setw(10)
+                 << seconds * 1000.0 / ms << "x realtime";
+            cout << line.str() << endl;
+        }
+    }
+
+    cout << "accuracy, error of a tone in dB" << endl;
+    for (u_int32_t from : rates)
+        for (auto [name, quality] : presets)
+        {
+            ostringstream line;
+            line << setw(6) << from << " -> " << pipelineRate << "  " << left << setw(8) << name << right
+                 << fixed << setprecision(1);
+            // Tones at the edges of the passbands of the presets, as parts of the lower Nyquist
+            const double nyquist = min(from, pipelineRate) / 2.0;
+            for (double part : {0.05, 0.45, 0.73, 0.82, 0.89})
+                line << setw(8) << part * nyquist / 1000 << " kHz " << setw(7)
+                     << toneError(part * nyquist, from, quality);
+
+            // What would fold back from above the new Nyquist
+            if (from > pipelineRate)
+                line << "   stopband " << setw(5) << (from == 48000 ? 23.0 : 30.0) << " kHz "
+                     << setw(7) << stopbandLevel(from == 48000 ? 23000 : 30000, from, quality);
+            cout << line.str() << endl;
+        }
+
+    return 0;
+}
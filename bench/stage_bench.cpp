@@ -0,0 +1,183 @@
+#include "./lib/sound_pr.hpp"
+
+// Throughput of every stage kernel and of a whole chain run stage by stage, in one
+// shared pass or with a thread per stage. Run from the build directory: ./bench/stage_bench [seconds]
+
+static const u_int32_t sampleRate = 44100;
+
+static vector<int16_t> makeSignal(u_int32_t seconds)
+{
+    // A tone with a little noise, loud enough that no stage sees silence
+    vector<int16_t> samples((size_t)seconds * sampleRate);
+    u_int32_t seed = 1;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        samples[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / sampleRate) + (int)(seed >> 24) - 128);
+    }
+    return samples;
+}
+
+static void writeWAV(string fileName, const vector<int16_t> &samples)
+{
+    WAVHeader header = {{'R', 'I', 'F', 'F'}, 0, {'W', 'A', 'V', 'E'}, {'f', 'm', 't', ' '}, 16, 1, 1,
+                        sampleRate, sampleRate * 2, 2, 16, {'d', 'a', 't', 'a'}, 0};
+    header.subchunk2Size = samples.size() * sizeof(int16_t);
+    header.chunkSize = sizeof(WAVHeader) - 8 + header.subchunk2Size;
+
+    ofstream fout(fileName, ios::binary | ios::trunc);
+    fout.write((const char *)&header, sizeof(WAVHeader));
+    fout.write((const char *)samples.data(), header.subchunk2Size);
+}
+
+template <typename F>
+static double measure(F &&body)
+{
+    auto start = chrono::steady_clock::now();
+    body();
+    return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+static void report(string name, double ms, u_int32_t seconds)
+{
+    ostringstream line;
+    line << left << setw(32) << name << right << setw(10) << fixed << setprecision(2) << ms << " ms"
+         << setw(12) << setprecision(0) << seconds * 1000.0 / ms << "x realtime";
+    cout << line.str() << endl;
+}
+
+int main(int argc, char **argv)
+{
+    const u_int32_t seconds = argc > 1 ? stoul(argv[1]) : 600;
+    const fs::path dir = fs::temp_directory_path() / ("stage_bench." + to_string(getpid()));
+    fs::create_directories(dir);
+
+    const vector<int16_t> signal = makeSignal(seconds);
+    writeWAV(dir / "in.wav", signal);
+    writeWAV(dir / "aux.wav", makeSignal(seconds / 2));
+
+    auto makeChain = [&]()
+    {
+        return vector<Converter *>{
+            new Filter("highpass", 80, 0, 0, 4),
+            new Filter("lowpass", 12000, 0, 0, 8),
+            new Filter("peaking", 3000, 4, 1.2, 2),
+            new Mute(seconds / 10, seconds / 5),
+            new Mix((dir / "aux.wav").string(), seconds / 4),
+            new Reverberation(seconds / 2, seconds, 0.3),
+            new Limiter(-1, 5, 2, 100),
+        };
+    };
+
+    // Kernels alone, on memory, in blocks of the size the reader delivers
+    cout << "kernels, " << seconds << " s of audio" << endl;
+    for (Converter *conv : makeChain())
+    {
+        vector<int16_t> samples = signal;
+        vector<int16_t> block;
+        double ms = measure([&]
+                            {
+            conv->prepare(sampleRate);
+            for (size_t pos = 0; pos < samples.size(); pos += sampleRate)
+            {
+                block.assign(samples.begin() + pos, samples.begin() + min(pos + sampleRate, samples.size()));
+                conv->processBlock(block, pos);
+            }
+            conv->flush(block); });
+        report(conv->describe(), ms, seconds);
+        delete conv;
+    }
+
+    // The denoiser learns its noise first, then runs as a kernel like the others
+    {
+        Denoise denoise(0, 1, 18);
+        denoise.learnNoise(vector<int16_t>(signal.begin(), signal.begin() + sampleRate));
+        vector<int16_t> block;
+        double ms = measure([&]
+                            {
+            denoise.prepare(sampleRate);
+            for (size_t pos = 0; pos < signal.size(); pos += sampleRate)
+            {
+                block.assign(signal.begin() + pos, signal.begin() + min(pos + sampleRate, signal.size()));
+                denoise.processBlock(block, pos);
+            }
+            denoise.flush(block); });
+        report(denoise.describe(), ms, seconds);
+    }
+
+    // A mostly silent input, as in a long recording with the pauses muted: every block through
+    // the kernels, against silent blocks offered to processSilence() first as a pass does
+    cout << "chain of 7 stages, 80% silence, on memory" << endl;
+    vector<int16_t> sparse = signal;
+    fill(sparse.begin() + sparse.size() / 10, sparse.begin() + sparse.size() * 9 / 10, 0);
+    for (bool skip : {false, true})
+    {
+        vector<Converter *> chain = makeChain();
+        vector<int16_t> block;
+        size_t skipped = 0;
+        double ms = measure([&]
+                            {
+            for (Converter *conv : chain)
+                conv->prepare(sampleRate);
+            for (size_t pos = 0; pos < sparse.size(); pos += sampleRate)
+            {
+                block.assign(sparse.begin() + pos, sparse.begin() + min(pos + sampleRate, sparse.size()));
+                bool silent = isSilent(block);
+                for (Converter *conv : chain)
+                {
+                    if (skip && silent && conv->processSilence(pos, block.size()))
+                        ++skipped;
+                    else
+                    {
+                        conv->processBlock(block, pos);
+                        silent = isSilent(block);
+                    }
+                }
+            } });
+        report(skip ? "skipping silent blocks" : "kernels on every block", ms, seconds);
+        if (skip)
+            cout << skipped << " of " << chain.size() * ((sparse.size() + sampleRate - 1) / sampleRate)
+                 << " kernel runs skipped" << endl;
+        for (Converter *conv : chain)
+            delete conv;
+    }
+
+    // The whole chain through files
+    cout << "chain of 7 stages" << endl;
+    ReadWAV reader;
+    WriteWAV writer;
+    for (bool fuse : {false, true})
+    {
+        vector<Converter *> chain = makeChain();
+        double ms = measure([&]
+                            {
+            pair<string, string> names{dir / "tmp1.wav", dir / "tmp2.wav"};
+            fs::copy(dir / "in.wav", names.first, fs::copy_options::overwrite_existing);
+            for (auto group : StreamPass::plan(chain, 0, fuse))
+            {
+                StreamPass::runGroup(chain, group, names.first, names.second, reader, writer);
+                swap(names.first, names.second);
+            } });
+        report(fuse ? "one shared pass" : "one pass per stage", ms, seconds);
+        for (Converter *conv : chain)
+            delete conv;
+    }
+
+    // The shared pass again with every stage on a thread of its own
+    {
+        vector<Converter *> chain = makeChain();
+        double ms = measure([&]
+                            {
+            StreamPass pass;
+            for (Converter *conv : chain)
+                pass.add(conv);
+            pass.setPipeline(PipelineConfig{chain.size(), 4, false});
+            pass.run(dir / "in.wav", dir / "tmp1.wav", reader, writer); });
+        report("one pass, a thread per stage", ms, seconds);
+        for (Converter *conv : chain)
+            delete conv;
+    }
+
+    fs::remove_all(dir);
+    return 0;
+}
\ No newline at end of file
@@ -0,0 +1,204 @@
+#include "./sound_pr.hpp"
+#include "./sound_pr_c.h"
+#include <cstring>
+
+// Implementation of the C interface, no exception gets past it
+
+struct sp_pipeline
+{
+    vector<unique_ptr<Converter>> convs;
+    StreamPass pass;
+    u_int32_t sampleRate = 0;
+    u_int32_t latency = 0;
+    // the block being run, kept between calls so that its memory is reused
+    vector<int16_t> block;
+    u_int64_t samplesIn = 0;
+    u_int64_t samplesOut = 0;
+    bool flushed = false;
+    string error;
+};
+
+static string errorText(const exception &e)
+{
+    // The messages end in a line break for the console, the caller gets them without
+    string text = e.what();
+    while (!text.empty() && text.back() == '\n')
+        text.pop_back();
+    return text;
+}
+
+static int fail(sp_pipeline *pipeline, string text)
+{
+    if (pipeline)
+        pipeline->error = text;
+    return -1;
+}
+
+int sp_api_version(void)
+{
+    return SP_API_VERSION;
+}
+
+sp_pipeline *sp_create(const char *config, uint32_t sample_rate, const sp_source *sources,
+                       size_t source_count, char *error, size_t error_size)
+{
+    string text;
+    try
+    {
+        if (!config || sample_rate == 0 || (source_count > 0 && !sources))
+            throw invalid_argument("Invalid parameters!\n");
+
+        auto pipeline = make_unique<sp_pipeline>();
+        pipeline->sampleRate = sample_rate;
+
+        // The sources get names of their own for the config to refer to as $1, $2, ...
+        // $0 would be the input, which is never a file here
+        vector<string> args{"sound_pr", "-c", "pipeline.txt", "out.wav", "in.wav"};
+        map<string, shared_ptr<const vector<int16_t>>> data;
+        for (size_t i = 0; i < source_count; ++i)
+        {
+            if (!sources[i].samples && sources[i].count > 0)
+                throw invalid_argument("Invalid parameters!\n");
+            args.push_back("source" + to_string(i + 1) + ".wav");
+            data[args.back()] = make_shared<const vector<int16_t>>(sources[i].samples,
+                                                                   sources[i].samples + sources[i].count);
+        }
+        ParseCmdLineArg parseArgs(args);
+
+        istringstream commands(config);
+        queue<Converter *> parsed = ParseConfigFile(string()).parsing(commands, parseArgs);
+        while (!parsed.empty())
+        {
+            pipeline->convs.emplace_back(parsed.front());
+            parsed.pop();
+        }
+
+        for (unique_ptr<Converter> &conv : pipeline->convs)
+        {
+            if (!conv->isStreamable() || conv->analyzesInput())
+                throw invalid_argument("Command " + conv->describe() + " cannot run on buffers!\n");
+            for (const string &name : conv->auxFiles())
+            {
+                auto it = data.find(name);
+                if (it == data.end())
+                    throw invalid_argument("Command " + conv->describe() + " has no source!\n");
+                conv->useAuxData(name, it->second);
+            }
+            pipeline->pass.add(conv.get());
+        }
+
+        pipeline->pass.begin(sample_rate);
+        for (unique_ptr<Converter> &conv : pipeline->convs)
+            pipeline->latency += conv->latency();
+
+        return pipeline.release();
+    }
+    catch (const exception &e)
+    {
+        text = errorText(e);
+    }
+    catch (...)
+    {
+        text = "Unknown error!";
+    }
+
+    if (error && error_size > 0)
+    {
+        size_t size = min(text.size(), error_size - 1);
+        memcpy(error, text.data(), size);
+        error[size] = '\0';
+    }
+    return nullptr;
+}
+
+int sp_process(sp_pipeline *pipeline, const int16_t *in, size_t count, int16_t *out, size_t *produced)
+{
+    if (!pipeline || !produced || (count > 0 && (!in || !out)))
+        return fail(pipeline, "Invalid parameters!");
+    if (pipeline->flushed)
+        return fail(pipeline, "The pipeline has been flushed!");
+
+    *produced = 0;
+    try
+    {
+        // A second at a time, as the blocks of a file go. What comes out never gets ahead
+        // of what went in, so out may be in.
+        for (size_t first = 0; first < count; first += pipeline->sampleRate)
+        {
+            const size_t size = min((size_t)pipeline->sampleRate, count - first);
+            pipeline->block.assign(in + first, in + first + size);
+            pipeline->pass.feed(pipeline->block);
+
+            if (*produced + pipeline->block.size() > first + size)
+                throw logic_error("The pipeline gave out more than it was given!\n");
+            memcpy(out + *produced, pipeline->block.data(), pipeline->block.size() * sizeof(int16_t));
+            *produced += pipeline->block.size();
+        }
+    }
+    catch (const exception &e)
+    {
+        return fail(pipeline, errorText(e));
+    }
+
+    pipeline->samplesIn += count;
+    pipeline->samplesOut += *produced;
+    return 0;
+}
+
+int sp_flush(sp_pipeline *pipeline, int16_t *out, size_t capacity, size_t *produced)
+{
+    if (!pipeline || !produced || (capacity > 0 && !out))
+        return fail(pipeline, "Invalid parameters!");
+    if (pipeline->flushed)
+        return fail(pipeline, "The pipeline has been flushed!");
+
+    // Checked before the tail leaves the commands, so a caller with too little room can try again
+    *produced = 0;
+    if (capacity < pipeline->latency)
+        return fail(pipeline, "The flush needs room for " + to_string(pipeline->latency) + " samples!");
+
+    try
+    {
+        pipeline->pass.finish(pipeline->block);
+        pipeline->flushed = true;
+        memcpy(out, pipeline->block.data(), pipeline->block.size() * sizeof(int16_t));
+        *produced = pipeline->block.size();
+    }
+    catch (const exception &e)
+    {
+        return fail(pipeline, errorText(e));
+    }
+
+    pipeline->samplesOut += *produced;
+    return 0;
+}
+
+uint32_t sp_latency(const sp_pipeline *pipeline)
+{
+    return pipeline ? pipeline->latency : 0;
+}
+
+int sp_get_stats(const sp_pipeline *pipeline, sp_stats *stats)
+{
+    if (!pipeline || !stats)
+        return -1;
+
+    PassStats pass = pipeline->pass.getStats();
+    stats->samples_in = pipeline->samplesIn;
+    stats->samples_out = pipeline->samplesOut;
+    stats->blocks = pass.blocks;
+    stats->silent_blocks = pass.silentBlocks;
+    stats->skipped_runs = pass.skippedRuns;
+    stats->idle_runs = pass.idleRuns;
+    return 0;
+}
+
+const char *sp_last_error(const sp_pipeline *pipeline)
+{
+    return pipeline ? pipeline->error.c_str() : "";
+}
+
+void sp_destroy(sp_pipeline *pipeline)
+{
+    delete pipeline;
+}
@@ -0,0 +1,155 @@
+#include "./sound_pr.hpp"
+#include <fcntl.h>
+
+// Flushes a file or a directory to the disk
+static void syncPath(const fs::path &path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Failed to sync " + path.string() + "!\n");
+    }
+    close(fd);
+}
+
+// Implementation of Checkpoint class methods
+
+Checkpoint::Checkpoint(fs::path dir, string key, u_int32_t interval)
+{
+    this->dir = dir;
+    this->key = key;
+    this->interval = chrono::seconds(interval);
+    this->last = chrono::steady_clock::now();
+}
+
+bool Checkpoint::load()
+{
+    // A checkpoint of another input or config, or a damaged one, is not used
+    ifstream in(this->dir / "checkpoint", ios::binary);
+    string magic, field, key;
+    if (!getline(in, magic) || magic != "sound_pr checkpoint 1")
+        return false;
+
+    CheckpointState state;
+    size_t members = 0;
+    in >> field >> key;
+    if (field != "key" || key != this->key)
+        return false;
+
+    in >> field >> state.group.first >> state.group.second;
+    in >> field >> ws;
+    getline(in, state.inputName);
+    in >> field >> ws;
+    getline(in, state.outputName);
+    in >> field >> state.read >> field >> state.written;
+    in >> field >> members;
+    state.positions.resize(members);
+    for (u_int64_t &position : state.positions)
+        in >> position;
+
+    in >> field;
+    if (!in || field != "state")
+        return false;
+
+    in.ignore(1);
+    state.states.resize(members);
+    for (string &text : state.states)
+    {
+        u_int64_t size = 0;
+        readRaw(in, size);
+        text.resize(size);
+        in.read(text.data(), size);
+    }
+
+    if (!in || !fs::exists(state.inputName) || !fs::exists(state.outputName))
+        return false;
+
+    this->state = state;
+    this->resuming = true;
+    this->stored = true;
+    return true;
+}
+
+bool Checkpoint::isResuming()
+{
+    return this->resuming;
+}
+
+void Checkpoint::resumed()
+{
+    this->resuming = false;
+    this->last = chrono::steady_clock::now();
+}
+
+void Checkpoint::startGroup(pair<size_t, size_t> group, string inFileName, string outFileName)
+{
+    // The input of the group is complete, so the group can always start over from here
+    this->state = CheckpointState();
+    this->state.group = group;
+    this->state.inputName = inFileName;
+    this->state.outputName = outFileName;
+    this->save();
+    this->last = chrono::steady_clock::now();
+}
+
+bool Checkpoint::due()
+{
+    auto now = chrono::steady_clock::now();
+    if (now - this->last < this->interval)
+        return false;
+
+    this->last = now;
+    return true;
+}
+
+void Checkpoint::save()
+{
+    // Written next to the old one and renamed over it, so a crash leaves one of the two
+    const fs::path part = this->dir / "checkpoint.part";
+    {
+        ofstream out(part, ios::binary | ios::trunc);
+        out << "sound_pr checkpoint 1\n"
+            << "key " << this->key << "\n"
+            << "group " << this->state.group.first << " " << this->state.group.second << "\n"
+            << "input " << this->state.inputName << "\n"
+            << "output " << this->state.outputName << "\n"
+            << "read " << this->state.read << "\n"
+            << "written " << this->state.written << "\n"
+            << "positions " << this->state.positions.size();
+        for (u_int64_t position : this->state.positions)
+            out << " " << position;
+        out << "\nstate\n";
+
+        // A group boundary has no member state yet
+        for (size_t i = 0; i < this->state.positions.size(); ++i)
+        {
+            const string &text = i < this->state.states.size() ? this->state.states[i] : string();
+            writeRaw(out, (u_int64_t)text.size());
+            out.write(text.data(), text.size());
+        }
+
+        if (!out)
+            throw runtime_error("Failed to write the checkpoint!\n");
+    }
+
+    syncPath(part);
+    fs::rename(part, this->dir / "checkpoint");
+    syncPath(this->dir);
+    this->stored = true;
+}
+
+void Checkpoint::clear()
+{
+    // What an earlier run left goes, the directory itself stays locked by the job
+    for (const fs::directory_entry &entry : fs::directory_iterator(this->dir))
+        fs::remove_all(entry.path());
+    this->resuming = false;
+    this->stored = false;
+}
+
+bool Checkpoint::hasState()
+{
+    return this->stored;
+}
@@ -0,0 +1,465 @@
+#include "./sound_pr.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <csignal>
+#include <cstring>
+
+// Set by SIGINT and SIGTERM, the accept loop polls it
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int)
+{
+    stopRequested = 1;
+}
+
+// Implementation of AuxCache class methods
+
+AuxCache::AuxCache(u_int64_t maxBytes)
+{
+    this->maxBytes = maxBytes;
+}
+
+shared_ptr<const vector<int16_t>> AuxCache::get(string fileName, ResampleQuality quality)
+{
+    // Entries are keyed by file identity and preset, so a changed file is decoded again
+    // and jobs with another --resample never get samples converted with the wrong filter
+    const string key = StageCache::fileIdentity(fileName) + "\nresample " + to_string((int)quality);
+    {
+        lock_guard<mutex> guard(this->lock);
+        for (auto it = this->entries.begin(); it != this->entries.end(); ++it)
+        {
+            if (it->first == key)
+            {
+                this->entries.splice(this->entries.begin(), this->entries, it);
+                return it->second;
+            }
+        }
+    }
+
+    // Decode outside the lock, other jobs keep going meanwhile
+    ReadWAV reader;
+    reader.setResampleQuality(quality);
+    reader.openWAVFile(fileName);
+    reader.parseHead();
+    reader.checkCorrect();
+
+    auto data = make_shared<vector<int16_t>>();
+    data->reserve(reader.getSampleCount());
+
+    vector<int16_t> samples;
+    while (reader.getSamples(samples, 0, reader.getSizeFile()))
+        data->insert(data->end(), samples.begin(), samples.end());
+    reader.closeWAVFile();
+
+    // The decoded files count against the memory budget for as long as they are cached
+    MemoryBudget &budget = MemoryBudget::global();
+    lock_guard<mutex> guard(this->lock);
+    this->entries.push_front({key, data});
+    this->usedBytes += data->size() * sizeof(int16_t);
+    budget.charge(data->size() * sizeof(int16_t));
+
+    // The entry just added stays even if it alone is over the limit, the job needs it
+    while (this->usedBytes > this->maxBytes && this->entries.size() > 1)
+    {
+        this->usedBytes -= this->entries.back().second->size() * sizeof(int16_t);
+        budget.release(this->entries.back().second->size() * sizeof(int16_t));
+        this->entries.pop_back();
+    }
+
+    // Over the memory budget the files no running job holds go as well, oldest first
+    auto it = this->entries.end();
+    while (budget.available() == 0 && --it != this->entries.begin())
+    {
+        if (it->second.use_count() > 1)
+            continue;
+        this->usedBytes -= it->second->size() * sizeof(int16_t);
+        budget.release(it->second->size() * sizeof(int16_t));
+        it = this->entries.erase(it);
+    }
+
+    return data;
+}
+
+AuxCache::~AuxCache()
+{
+    MemoryBudget::global().release(this->usedBytes);
+}
+
+// Implementation of Server class methods
+
+Server::Server(string socketName, size_t workers, u_int64_t auxCacheBytes) : auxCache(auxCacheBytes)
+{
+    this->socketName = socketName;
+    this->workers = max((size_t)1, workers);
+}
+
+void Server::serve()
+{
+    // Listens on the socket until SIGINT or SIGTERM, then finishes the running jobs
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, requestStop);
+    signal(SIGTERM, requestStop);
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (this->socketName.size() >= sizeof(addr.sun_path))
+        throw invalid_argument("The socket path is too long!\n");
+    strncpy(addr.sun_path, this->socketName.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(this->socketName.c_str());
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+        throw runtime_error("Failed to open the socket " + this->socketName + "!\n");
+
+    cout << "serving on " << this->socketName << " with " << this->workers << " workers" << endl;
+
+    vector<thread> pool;
+    for (size_t i = 0; i < this->workers; ++i)
+        pool.emplace_back(&Server::workerLoop, this);
+
+    while (!stopRequested && !this->stopAsked)
+    {
+        // Beyond maxClients connections are not accepted until a client is done
+        this->joinClients(false);
+        if (this->clients.size() >= maxClients)
+        {
+            this_thread::sleep_for(chrono::milliseconds(10));
+            continue;
+        }
+
+        pollfd pfd{fd, POLLIN, 0};
+        if (poll(&pfd, 1, 500) <= 0)
+            continue;
+
+        int client = accept(fd, nullptr, nullptr);
+        if (client >= 0)
+        {
+            this->clients.push_back(make_unique<ServerClient>());
+            ServerClient *entry = this->clients.back().get();
+            entry->fd = client;
+            entry->worker = thread(&Server::handleClient, this, entry);
+        }
+    }
+
+    // Queued jobs are cancelled, running ones are asked to stop
+    {
+        lock_guard<mutex> guard(this->lock);
+        this->stopping = true;
+        for (auto &[id, job] : this->active)
+            job->cancelled = true;
+    }
+    this->pending.notify_all();
+
+    for (thread &worker : pool)
+        worker.join();
+
+    // Every job has its reply by now. Clients still sending a request are cut off, they get
+    // refused as the server is stopping, and no client thread outlives the server.
+    for (auto &client : this->clients)
+        if (!client->done)
+            shutdown(client->fd, SHUT_RD);
+    this->joinClients(true);
+
+    close(fd);
+    unlink(this->socketName.c_str());
+}
+
+void Server::stop()
+{
+    this->stopAsked = true;
+}
+
+void Server::joinClients(bool all)
+{
+    for (auto it = this->clients.begin(); it != this->clients.end();)
+    {
+        if (!all && !(*it)->done)
+        {
+            ++it;
+            continue;
+        }
+        (*it)->worker.join();
+        close((*it)->fd);
+        it = this->clients.erase(it);
+    }
+}
+
+void Server::workerLoop()
+{
+    while (true)
+    {
+        shared_ptr<ServerJob> job;
+        {
+            unique_lock<mutex> guard(this->lock);
+            this->pending.wait(guard, [this]
+                               { return this->stopping || !this->jobs.empty(); });
+            if (this->jobs.empty())
+                return;
+
+            job = this->jobs.front();
+            this->jobs.pop_front();
+            ++this->running;
+        }
+
+        // Every job gets its own parsed arguments, converters, reader and writer
+        string result;
+        bool ok = false;
+        double ms = 0.0;
+        try
+        {
+            if (job->cancelled)
+                throw runtime_error("The job was cancelled!\n");
+
+            ParseCmdLineArg args(job->args);
+            ParseConfigFile parser(args.getConfFileName());
+            istringstream config(job->config);
+            Job run(args, parser.parsing(config, args), &job->cancelled, &this->auxCache);
+            run.run();
+
+            ms = chrono::duration<double, milli>(chrono::steady_clock::now() - job->submitted).count();
+            result = "DONE " + to_string(job->id) + " " + to_string(ms) + "\n";
+            ok = true;
+        }
+        catch (const exception &e)
+        {
+            string message = e.what();
+            while (!message.empty() && message.back() == '\n')
+                message.pop_back();
+            result = (job->cancelled ? "CANCELLED " : "FAILED ") + to_string(job->id) + " " + message + "\n";
+        }
+
+        {
+            lock_guard<mutex> guard(this->lock);
+            --this->running;
+            this->active.erase(job->id);
+
+            if (ok)
+            {
+                ++this->completed;
+                this->latencies.push_back(ms);
+                if (this->latencies.size() > 1024)
+                    this->latencies.pop_front();
+            }
+            else if (job->cancelled)
+                ++this->cancelledJobs;
+            else
+                ++this->failed;
+        }
+
+        {
+            lock_guard<mutex> guard(job->lock);
+            job->finished = true;
+            job->result = result;
+        }
+        job->done.notify_all();
+    }
+}
+
+shared_ptr<ServerJob> Server::submit(istream &in)
+{
+    // Request body: "out", "in", "aux" and "opt" lines, then "config" and the config text
+    auto job = make_shared<ServerJob>();
+    string out, main, key, value;
+    vector<string> aux, opts;
+
+    while (in >> key && key != "config")
+    {
+        getline(in >> ws, value);
+        if (key == "out")
+            out = value;
+        else if (key == "in")
+            main = value;
+        else if (key == "aux")
+            aux.push_back(value);
+        else if (key == "opt")
+            opts.push_back(value);
+        else
+            throw invalid_argument("Unknown job field " + key + "!\n");
+    }
+
+    if (out.empty() || main.empty())
+        throw invalid_argument("The job has no input or output file!\n");
+
+    // Options of the process, such as --serve or --mem-limit, belong to the daemon and not to a job
+    static const vector<string> jobOptions = {"--cache-dir", "--cache-size", "--checkpoint", "--io",
+                                              "--no-cache", "--no-fuse", "--no-incremental", "--pin-cores",
+                                              "--pipeline", "--pipeline-depth", "--resample", "--resume"};
+    vector<string> paths{out, main};
+    paths.insert(paths.end(), aux.begin(), aux.end());
+    for (const string &opt : opts)
+    {
+        const string name = opt.substr(0, opt.find('='));
+        if (find(jobOptions.begin(), jobOptions.end(), name) == jobOptions.end())
+            throw invalid_argument("The option " + name + " cannot be given to a job!\n");
+        if (name == "--cache-dir" && opt.size() > name.size())
+            paths.push_back(opt.substr(name.size() + 1));
+    }
+
+    // The daemon runs in a directory of its own, so paths relative to the client's would go astray
+    for (const string &path : paths)
+        if (!fs::path(path).is_absolute())
+            throw invalid_argument("The path " + path + " of the job is not absolute!\n");
+
+    in.ignore(1);
+    job->config.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+
+    // The config text never touches the disk, the name only passes the argument checks
+    job->args = {"sound_pr", "-c", "job_config.txt", out, main};
+    job->args.insert(job->args.end(), aux.begin(), aux.end());
+    job->args.insert(job->args.end(), opts.begin(), opts.end());
+    job->submitted = chrono::steady_clock::now();
+
+    // Check the arguments now, so that a bad job is rejected before it is queued
+    ParseCmdLineArg check(job->args);
+
+    lock_guard<mutex> guard(this->lock);
+    if (this->stopping)
+        throw runtime_error("The server is shutting down!\n");
+
+    job->id = this->nextId++;
+    this->jobs.push_back(job);
+    this->active[job->id] = job;
+    this->pending.notify_one();
+    return job;
+}
+
+string Server::cancel(u_int64_t id)
+{
+    // A queued job is dropped when a worker takes it, a running one stops at its next read
+    lock_guard<mutex> guard(this->lock);
+    auto it = this->active.find(id);
+    if (it == this->active.end())
+        return "UNKNOWN " + to_string(id) + "\n";
+
+    it->second->cancelled = true;
+    return "OK " + to_string(id) + "\n";
+}
+
+string Server::stats()
+{
+    MemoryBudget &budget = MemoryBudget::global();
+    lock_guard<mutex> guard(this->lock);
+
+    vector<double> sorted(this->latencies.begin(), this->latencies.end());
+    sort(sorted.begin(), sorted.end());
+
+    double avg = 0.0;
+    for (double ms : sorted)
+        avg += ms;
+    if (!sorted.empty())
+        avg /= sorted.size();
+
+    auto percentile = [&](double p)
+    {
+        return sorted.empty() ? 0.0 : sorted[min(sorted.size() - 1, (size_t)(p * sorted.size()))];
+    };
+
+    ostringstream out;
+    out << fixed << setprecision(3)
+        << "STATS queued=" << this->jobs.size() << " running=" << this->running
+        << " completed=" << this->completed << " failed=" << this->failed
+        << " cancelled=" << this->cancelledJobs << " workers=" << this->workers
+        << " avg_ms=" << avg << " p50_ms=" << percentile(0.5) << " p95_ms=" << percentile(0.95)
+        << " max_ms=" << (sorted.empty() ? 0.0 : sorted.back())
+        << " mem_used_mb=" << budget.getUsed() / 1048576.0 << " mem_peak_mb=" << budget.getPeak() / 1048576.0
+        << " mem_limit_mb=" << budget.getLimit() / 1048576.0 << " mem_waiting=" << budget.getWaiting() << "\n";
+    return out.str();
+}
+
+void Server::handleClient(ServerClient *client)
+{
+    // A client writes one request and shuts down its side, the reply ends with the connection
+    const int fd = client->fd;
+    string request;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+        request.append(buffer, count);
+
+    istringstream in(request);
+    string command, reply;
+    in >> command;
+
+    auto send = [fd](const string &text)
+    {
+        size_t sent = 0;
+        while (sent < text.size())
+        {
+            ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+            if (n <= 0)
+                return;
+            sent += n;
+        }
+    };
+
+    try
+    {
+        if (command == "JOB")
+        {
+            shared_ptr<ServerJob> job = this->submit(in);
+            send("QUEUED " + to_string(job->id) + "\n");
+
+            unique_lock<mutex> guard(job->lock);
+            job->done.wait(guard, [&job]
+                           { return job->finished; });
+            reply = job->result;
+        }
+        else if (command == "CANCEL")
+        {
+            u_int64_t id = 0;
+            in >> id;
+            reply = this->cancel(id);
+        }
+        else if (command == "STATS")
+            reply = this->stats();
+        else
+            reply = "ERROR Unknown request\n";
+    }
+    catch (const exception &e)
+    {
+        string message = e.what();
+        while (!message.empty() && message.back() == '\n')
+            message.pop_back();
+        reply = "FAILED " + message + "\n";
+    }
+
+    send(reply);
+    shutdown(fd, SHUT_RDWR);
+    client->done = true;
+}
+
+string Server::request(string socketName, string text)
+{
+    // Sends one request to the daemon and returns everything it replies
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketName.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Failed to connect to " + socketName + "!\n");
+    }
+
+    size_t sent = 0;
+    while (sent < text.size())
+    {
+        ssize_t n = write(fd, text.data() + sent, text.size() - sent);
+        if (n <= 0)
+            break;
+        sent += n;
+    }
+    shutdown(fd, SHUT_WR);
+
+    string reply;
+    char buffer[4096];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0)
+        reply.append(buffer, count);
+
+    close(fd);
+    return reply;
+}
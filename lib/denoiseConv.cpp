@@ -0,0 +1,206 @@
+#include "./sound_pr.hpp"
+
+// Constructor for the Denoise class, the noise spectrum is learned in convert()
+Denoise::Denoise(u_int32_t from, u_int32_t to, double reductionDb) : stft(frameSize, hop)
+{
+    this->from = from;
+    this->to = to;
+    this->reductionDb = reductionDb;
+}
+
+void Denoise::learnNoise(const vector<int16_t> &samples)
+{
+    // Mean magnitude of every bin over the frames that lie wholly inside the samples
+    if (samples.size() < frameSize)
+        throw invalid_argument("The noise range of denoise is too short!\n");
+
+    const size_t bins = frameSize / 2 + 1;
+    const size_t warmup = frameSize / hop - 1;
+    size_t frames = 0;
+    this->noise.assign(bins, 0.0);
+
+    STFT analysis(frameSize, hop);
+    vector<double> unused;
+    for (size_t pos = 0; pos < samples.size(); pos += 64 * hop)
+    {
+        analysis.process(samples.data() + pos, min(64 * hop, samples.size() - pos), unused,
+                         [&](vector<complex<double>> &spectrum)
+                         {
+                             // The first frames still overlap the silence before the samples
+                             if (frames++ < warmup)
+                                 return;
+                             for (size_t k = 0; k < bins; ++k)
+                                 this->noise[k] += abs(spectrum[k]);
+                         });
+        unused.clear();
+    }
+
+    for (double &magnitude : this->noise)
+        magnitude /= frames - warmup;
+}
+
+void Denoise::prepare(u_int32_t)
+{
+    // The noise profile stays, the stream state starts over
+    this->stft.reset();
+    this->gains.assign(frameSize / 2 + 1, 1.0);
+    this->mask.assign(frameSize / 2 + 1, 1.0);
+    this->resynth.clear();
+    this->skip = this->stft.latency();
+    this->pending = 0;
+}
+
+void Denoise::gate(vector<complex<double>> &spectrum)
+{
+    if (this->noise.empty())
+        return;
+
+    // Bins less than about 10 dB above the noise are turned down to the floor
+    const size_t bins = frameSize / 2 + 1;
+    const double floor = pow(10.0, -this->reductionDb / 20.0);
+    for (size_t k = 0; k < bins; ++k)
+        this->mask[k] = abs(spectrum[k]) > 3.0 * this->noise[k] ? 1.0 : floor;
+
+    for (size_t k = 0; k < bins; ++k)
+    {
+        // Smoothing over neighbouring bins, then over time: the gate opens at once
+        // and closes over a few frames
+        double left = this->mask[k > 0 ? k - 1 : k];
+        double right = this->mask[k + 1 < bins ? k + 1 : k];
+        double target = 0.25 * left + 0.5 * this->mask[k] + 0.25 * right;
+
+        this->gains[k] = target > this->gains[k] ? target : target + (this->gains[k] - target) * 0.7;
+        spectrum[k] *= this->gains[k];
+    }
+}
+
+void Denoise::processBlock(vector<int16_t> &samples, u_int64_t)
+{
+    this->pending += samples.size();
+    this->stft.process(samples.data(), samples.size(), this->resynth,
+                       [this](vector<complex<double>> &spectrum)
+                       { this->gate(spectrum); });
+
+    // The first samples out of the overlap-add belong to the silence before the stream
+    size_t dropped = min((u_int64_t)this->resynth.size(), this->skip);
+    this->skip -= dropped;
+
+    const size_t count = min((u_int64_t)(this->resynth.size() - dropped), this->pending);
+    samples.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        double y = max(min(this->resynth[dropped + i], (double)INT16_MAX), (double)INT16_MIN);
+        samples[i] = (int16_t)(y + (y < 0 ? -0.5 : 0.5));
+    }
+
+    this->pending -= count;
+    this->resynth.clear();
+}
+
+u_int32_t Denoise::latency()
+{
+    return this->stft.latency();
+}
+
+void Denoise::flush(vector<int16_t> &samples)
+{
+    // Silence after the end pushes the held back samples out, the rest of it is cut off
+    u_int64_t pending = this->pending;
+    samples.assign(this->stft.latency() + hop, 0);
+    this->processBlock(samples, 0);
+    samples.resize(min((u_int64_t)samples.size(), pending));
+    this->pending = 0;
+}
+
+void Denoise::analyze(string inFileName, ReadWAV &reader)
+{
+    // The noise is learned from the input of this stage before its pass starts
+    reader.openWAVFile(inFileName);
+    reader.parseHead();
+    reader.checkCorrect();
+
+    vector<int16_t> noise, samples;
+    while (reader.getSamples(samples, this->from, this->to))
+        noise.insert(noise.end(), samples.begin(), samples.end());
+    reader.closeWAVFile();
+
+    this->learnNoise(noise);
+}
+
+void Denoise::saveState(ostream &out)
+{
+    // The noise profile is learned again by analyze() when a pass goes on from a checkpoint
+    this->stft.saveState(out);
+    writeRaw(out, this->gains);
+    writeRaw(out, this->skip);
+    writeRaw(out, this->pending);
+}
+
+void Denoise::loadState(istream &in)
+{
+    this->stft.loadState(in);
+    readRaw(in, this->gains);
+    readRaw(in, this->skip);
+    readRaw(in, this->pending);
+}
+
+u_int64_t Denoise::memoryUse(u_int32_t, size_t count)
+{
+    // The frames of the transform, the spectra of the gate and the resynthesized block
+    return frameSize * (3 * sizeof(double) + 3 * sizeof(complex<double>) / 2) +
+           3 * (frameSize / 2 + 1) * sizeof(double) + count * sizeof(double);
+}
+
+void Denoise::convert(string inFileName, string outFileName, ReadWAV &reader, WriteWAV &writer)
+{
+    // On its own the denoiser is a pass with a single member
+    StreamPass pass;
+    pass.add(this);
+    pass.run(inFileName, outFileName, reader, writer);
+}
+
+string Denoise::describe()
+{
+    ostringstream out;
+    out << setprecision(17) << "denoise " << this->from << " " << this->to << " " << this->reductionDb;
+    return out.str();
+}
+
+pair<u_int64_t, u_int64_t> Denoise::affectedRange(u_int32_t sampleRate)
+{
+    // The denoiser works on the whole stream
+    return {0, (u_int64_t)numeric_limits<u_int32_t>::max() * sampleRate};
+}
+
+bool Denoise::hasMemory()
+{
+    return true;
+}
+
+Converter *Denoise::window(u_int32_t from, u_int32_t)
+{
+    // The gains carry over from frame to frame and the noise is learned inside the window.
+    // The window covers the whole stream, cut at its end, so a noise range past the end of
+    // the file ends there, as it does when the whole file is rendered.
+    if (from != 0)
+        throw logic_error("Denoise window must include the start of the stream!\n");
+
+    return new Denoise(this->from, this->to, this->reductionDb);
+}
+
+void Denoise::help()
+{
+    cout << "\033[33m   Denoise\033[0m" << endl
+         << "Learns the noise spectrum from seconds <s1> to <s2> of the sound and turns down" << endl
+         << "by <r> dB every part of the spectrum that does not rise 10 dB above it" << endl
+         << "denoise <s1> <s2> <r>, pick a range that holds only the noise" << endl
+         << "Example: denoise 0 2 18" << endl
+         << endl;
+}
+
+// Factory method for creating Denoise converters
+Converter *DenoiseCreater::creatConverter(u_int32_t from, u_int32_t to, double reductionDb)
+{
+    Denoise *denoise = new Denoise(from, to, reductionDb);
+    return denoise;
+}
@@ -0,0 +1,156 @@
+#include "./sound_pr.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstring>
+
+// Implementation of DirectFile class methods
+
+DirectFile::~DirectFile()
+{
+    this->close();
+}
+
+bool DirectFile::open(string fileName, bool writable)
+{
+    this->close();
+
+    this->fd = ::open(fileName.c_str(), (writable ? O_RDWR : O_RDONLY) | O_DIRECT);
+    if (this->fd < 0)
+    {
+        // Some file systems (tmpfs, some network ones) refuse O_DIRECT
+        if (errno == EINVAL)
+            return false;
+        throw runtime_error("Failed to open the file. Please check the file name or path.\n");
+    }
+
+    struct stat info;
+    fstat(this->fd, &info);
+    this->fileSize = info.st_size;
+
+    if (!this->buffer)
+        this->buffer = (char *)aligned_alloc(blockSize, capacity);
+    if (!this->buffer)
+    {
+        ::close(this->fd);
+        this->fd = -1;
+        throw bad_alloc();
+    }
+    this->loaded = false;
+    this->dirty = false;
+    return true;
+}
+
+void DirectFile::close()
+{
+    if (this->fd >= 0)
+    {
+        this->flush();
+        ::close(this->fd);
+        this->fd = -1;
+    }
+
+    free(this->buffer);
+    this->buffer = nullptr;
+}
+
+int DirectFile::getFd()
+{
+    return this->fd;
+}
+
+void DirectFile::load(u_int64_t start)
+{
+    // The window starts on a block, a short read means the file ends inside it
+    this->flush();
+    this->windowStart = start & ~(u_int64_t)(blockSize - 1);
+
+    ssize_t count = pread(this->fd, this->buffer, capacity, this->windowStart);
+    if (count < 0)
+        throw runtime_error("Failed to read the file!\n");
+
+    this->windowValid = count;
+    memset(this->buffer + count, 0, capacity - count);
+    this->loaded = true;
+}
+
+size_t DirectFile::read(u_int64_t offset, char *data, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        if (!this->loaded || offset < this->windowStart || offset >= this->windowStart + capacity)
+            this->load(offset);
+
+        if (offset >= this->windowStart + this->windowValid)
+            break;
+
+        size_t count = min(size - done, (size_t)(this->windowStart + this->windowValid - offset));
+        memcpy(data + done, this->buffer + (offset - this->windowStart), count);
+        done += count;
+        offset += count;
+    }
+
+    return done;
+}
+
+void DirectFile::write(u_int64_t offset, const char *data, size_t size)
+{
+    while (size > 0)
+    {
+        if (!this->loaded || offset < this->windowStart || offset >= this->windowStart + capacity)
+            this->load(offset);
+
+        size_t count = min(size, (size_t)(this->windowStart + capacity - offset));
+        memcpy(this->buffer + (offset - this->windowStart), data, count);
+        this->windowValid = max(this->windowValid, (size_t)(offset + count - this->windowStart));
+        this->dirty = true;
+
+        data += count;
+        offset += count;
+        size -= count;
+    }
+}
+
+void DirectFile::flush()
+{
+    if (!this->dirty)
+        return;
+
+    // Whole blocks go out, the padding after the end of the file is cut off again
+    size_t bytes = (this->windowValid + blockSize - 1) & ~(blockSize - 1);
+    if (pwrite(this->fd, this->buffer, bytes, this->windowStart) != (ssize_t)bytes)
+        throw runtime_error("Failed to write the file!\n");
+
+    const u_int64_t end = this->windowStart + this->windowValid;
+    this->fileSize = max(this->fileSize, end);
+    if (this->windowStart + bytes > this->fileSize && ftruncate(this->fd, this->fileSize) < 0)
+        throw runtime_error("Failed to write the file!\n");
+
+    this->dirty = false;
+}
+
+bool DirectFile::punch(u_int64_t offset, u_int64_t size)
+{
+    // The window goes back first and is loaded again later, so it never covers the hole with old bytes
+    this->flush();
+    if (this->loaded && offset < this->windowStart + capacity && this->windowStart < offset + size)
+        this->loaded = false;
+
+    // A hole at the end still counts as part of the file, and only ranges inside the
+    // file are punched: the blocks reserved past its end would stay allocated otherwise
+    if (offset + size > this->fileSize)
+    {
+        this->fileSize = offset + size;
+        if (ftruncate(this->fd, this->fileSize) < 0)
+            throw runtime_error("Failed to write the file!\n");
+    }
+
+    if (fallocate(this->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) < 0)
+        return false;
+    return true;
+}
+
+u_int64_t DirectFile::memoryUse()
+{
+    return this->buffer ? capacity : 0;
+}
@@ -0,0 +1,242 @@
+#include "./sound_pr.hpp"
+
+// Constructor for the Filter class, the sections are designed once the sample rate is known
+Filter::Filter(string kind, double freq, double gain, double q, int order)
+{
+    this->kind = kind;
+    this->freq = freq;
+    this->gain = gain;
+    this->q = q;
+    this->order = order;
+}
+
+vector<Biquad> Filter::design(string kind, double freq, double gain, double q, int order, u_int32_t sampleRate)
+{
+    // Coefficients follow the Audio EQ Cookbook (R. Bristow-Johnson)
+    if (freq >= sampleRate / 2.0)
+        throw invalid_argument("The filter frequency must be below half the sampling rate!\n");
+
+    const double w0 = 2.0 * M_PI * freq / sampleRate;
+    const double cosw = cos(w0);
+    const double sinw = sin(w0);
+    const double A = pow(10.0, gain / 40.0);
+    vector<Biquad> sections;
+
+    auto normalize = [&](double b0, double b1, double b2, double a0, double a1, double a2)
+    {
+        sections.push_back({b0 / a0, b1 / a0, b2 / a0, a1 / a0, a2 / a0});
+    };
+
+    if (kind == "highpass" || kind == "lowpass")
+    {
+        // Butterworth: pairs of poles become biquads, an odd order adds a first-order section
+        const bool high = kind == "highpass";
+        for (int k = 0; k < order / 2; ++k)
+        {
+            double alpha = sinw * cos(M_PI * (2 * k + 1) / (2.0 * order));
+            if (high)
+                normalize((1 + cosw) / 2, -(1 + cosw), (1 + cosw) / 2, 1 + alpha, -2 * cosw, 1 - alpha);
+            else
+                normalize((1 - cosw) / 2, 1 - cosw, (1 - cosw) / 2, 1 + alpha, -2 * cosw, 1 - alpha);
+        }
+
+        if (order % 2)
+        {
+            double K = tan(w0 / 2);
+            if (high)
+                normalize(1, -1, 0, K + 1, K - 1, 0);
+            else
+                normalize(K, K, 0, K + 1, K - 1, 0);
+        }
+    }
+    else
+    {
+        const double alpha = sinw / (2 * q);
+        const double root = 2 * sqrt(A) * alpha;
+
+        if (kind == "peaking")
+            normalize(1 + alpha * A, -2 * cosw, 1 - alpha * A, 1 + alpha / A, -2 * cosw, 1 - alpha / A);
+        else if (kind == "lowshelf")
+            normalize(A * ((A + 1) - (A - 1) * cosw + root), 2 * A * ((A - 1) - (A + 1) * cosw),
+                      A * ((A + 1) - (A - 1) * cosw - root), (A + 1) + (A - 1) * cosw + root,
+                      -2 * ((A - 1) + (A + 1) * cosw), (A + 1) + (A - 1) * cosw - root);
+        else if (kind == "highshelf")
+            normalize(A * ((A + 1) + (A - 1) * cosw + root), -2 * A * ((A - 1) + (A + 1) * cosw),
+                      A * ((A + 1) + (A - 1) * cosw - root), (A + 1) - (A - 1) * cosw + root,
+                      2 * ((A - 1) - (A + 1) * cosw), (A + 1) - (A - 1) * cosw - root);
+        else
+            throw invalid_argument("Unknown filter " + kind + "!\n");
+    }
+
+    return sections;
+}
+
+void Filter::prepare(u_int32_t sampleRate)
+{
+    // Unused lanes pass their input through and are never read
+    vector<Biquad> sections = design(this->kind, this->freq, this->gain, this->q, this->order, sampleRate);
+    this->count = sections.size();
+
+    for (size_t k = 0; k < lanes; ++k)
+    {
+        Biquad section = k < this->count ? sections[k] : Biquad{1, 0, 0, 0, 0};
+        this->b0[k] = section.b0;
+        this->b1[k] = section.b1;
+        this->b2[k] = section.b2;
+        this->a1[k] = section.a1;
+        this->a2[k] = section.a2;
+    }
+
+    this->z1.fill(0);
+    this->z2.fill(0);
+    this->in.fill(0);
+    this->out.fill(0);
+}
+
+template <size_t width>
+void Filter::runCascade(vector<int16_t> &samples)
+{
+    // Section k handles sample t - k at step t, so the cascade fills up during the first
+    // count - 1 steps of a block and drains during the last ones. Only those steps need
+    // per-section bounds, all others run the first width lanes at once.
+    const size_t n = samples.size();
+    const size_t last = this->count - 1;
+
+    double *b0 = this->b0.data(), *b1 = this->b1.data(), *b2 = this->b2.data();
+    double *a1 = this->a1.data(), *a2 = this->a2.data();
+    double *z1 = this->z1.data(), *z2 = this->z2.data();
+    double *in = this->in.data(), *out = this->out.data();
+
+    auto section = [&](size_t k)
+    {
+        double y = b0[k] * in[k] + z1[k];
+        z1[k] = b1[k] * in[k] - a1[k] * y + z2[k];
+        z2[k] = b2[k] * in[k] - a2[k] * y;
+        out[k] = y;
+    };
+
+    for (size_t t = 0; t < n + last; ++t)
+    {
+        in[0] = t < n ? samples[t] : 0;
+
+        if (t >= last && t < n)
+        {
+            for (size_t k = 0; k < width; ++k)
+                section(k);
+        }
+        else
+        {
+            for (size_t k = t >= n ? t - n + 1 : 0; k <= min(t, last); ++k)
+                section(k);
+        }
+
+        if (t >= last)
+        {
+            // Clamp, then round half away from zero without a library call
+            double y = max(min(out[last], (double)INT16_MAX), (double)INT16_MIN);
+            samples[t - last] = (int16_t)(y + (y < 0 ? -0.5 : 0.5));
+        }
+
+        // The output of each section is the input of the next one at the next step
+        for (size_t k = width - 1; k > 0; --k)
+            in[k] = out[k - 1];
+    }
+}
+
+void Filter::processBlock(vector<int16_t> &samples, u_int64_t)
+{
+    // The narrowest lane count that holds the cascade
+    if (this->count == 1)
+        this->runCascade<1>(samples);
+    else if (this->count == 2)
+        this->runCascade<2>(samples);
+    else if (this->count <= 4)
+        this->runCascade<4>(samples);
+    else
+        this->runCascade<lanes>(samples);
+}
+
+bool Filter::processSilence(u_int64_t, size_t)
+{
+    // Zeros into a cascade at rest give zeros out and leave it at rest. A decaying state never
+    // quite reaches zero in doubles, so one far below any rounding step of the output is
+    // taken as rest and cleared.
+    const double rest = 1e-200;
+    for (size_t k = 0; k < lanes; ++k)
+        if (abs(this->z1[k]) > rest || abs(this->z2[k]) > rest || abs(this->in[k]) > rest || abs(this->out[k]) > rest)
+            return false;
+
+    this->z1.fill(0);
+    this->z2.fill(0);
+    this->in.fill(0);
+    this->out.fill(0);
+    return true;
+}
+
+void Filter::saveState(ostream &out)
+{
+    // The coefficients come from prepare(), only the section memory carries over
+    writeRaw(out, this->z1);
+    writeRaw(out, this->z2);
+    writeRaw(out, this->in);
+    writeRaw(out, this->out);
+}
+
+void Filter::loadState(istream &in)
+{
+    readRaw(in, this->z1);
+    readRaw(in, this->z2);
+    readRaw(in, this->in);
+    readRaw(in, this->out);
+}
+
+void Filter::convert(string inFileName, string outFileName, ReadWAV &reader, WriteWAV &writer)
+{
+    // On its own the filter is a pass with a single member
+    StreamPass pass;
+    pass.add(this);
+    pass.run(inFileName, outFileName, reader, writer);
+}
+
+string Filter::describe()
+{
+    ostringstream out;
+    out << setprecision(17) << this->kind << " " << this->freq;
+    if (this->kind == "highpass" || this->kind == "lowpass")
+        out << " " << this->order;
+    else
+        out << " " << this->gain << " " << this->q;
+    return out.str();
+}
+
+pair<u_int64_t, u_int64_t> Filter::affectedRange(u_int32_t sampleRate)
+{
+    // The filter works on the whole stream
+    return {0, (u_int64_t)numeric_limits<u_int32_t>::max() * sampleRate};
+}
+
+bool Filter::hasMemory()
+{
+    return true;
+}
+
+Converter *Filter::window(u_int32_t from, u_int32_t)
+{
+    // The filter state builds up from the start of the stream
+    if (from != 0)
+        throw logic_error("Filter window must include the start of the stream!\n");
+
+    return new Filter(this->kind, this->freq, this->gain, this->q, this->order);
+}
+
+void Filter::help()
+{
+    cout << "\033[33m   Filters\033[0m" << endl
+         << "Butterworth highpass or lowpass of order <o> with cutoff <f> Hz," << endl
+         << "orders above 2 are built as a cascade of second-order sections" << endl
+         << "highpass <f> <o>, lowpass <f> <o>" << endl
+         << "Equalizer band at <f> Hz with gain <g> dB and quality <q>" << endl
+         << "peaking <f> <g> <q>, lowshelf <f> <g> <q>, highshelf <f> <g> <q>" << endl
+         << "Example: highpass 80 4" << endl
+         << endl;
+}
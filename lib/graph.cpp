@@ -0,0 +1,293 @@
+#include "./sound_pr.hpp"
+
+// Implementation of EffectGraph class methods
+
+EffectGraph::~EffectGraph()
+{
+    // Removes unfinished outputs and the converters the graph owns
+    error_code ec;
+    for (const string &part : this->parts)
+        fs::remove(part, ec);
+
+    for (GraphStream &stream : this->streams)
+        delete stream.conv;
+}
+
+size_t EffectGraph::lookup(const string &name)
+{
+    auto it = this->names.find(name);
+    if (it == this->names.end())
+        throw invalid_argument("Unknown stream " + name + " in the graph!\n");
+    return it->second;
+}
+
+void EffectGraph::parse(istream &fin, ParseCmdLineArg &parseArgs)
+{
+    // Every line defines one stream or one output, empty lines and # comments are skipped
+    GraphStream input;
+    input.name = "input";
+    this->streams.push_back(input);
+    this->names["input"] = 0;
+
+    string line;
+    while (getline(fin, line))
+    {
+        istringstream words(line);
+        string first, second;
+        if (!(words >> first) || first.starts_with("#"))
+            continue;
+
+        if (first == "out")
+        {
+            string fileName;
+            words >> second >> fileName;
+            if (!(fileName.ends_with(".wav") && fileName.length() > 4))
+                throw invalid_argument("Invalid WAV file format!\n");
+            for (auto &[stream, name] : this->outputs)
+                if (fs::absolute(name) == fs::absolute(fileName))
+                    throw invalid_argument("Output " + fileName + " is written twice!\n");
+
+            this->outputs.push_back({this->lookup(second), fileName});
+            continue;
+        }
+
+        // <name> = <stream> | <command> | <command> ...
+        if (!(words >> second) || second != "=" || this->names.count(first))
+            throw invalid_argument("Invalid graph line: " + line + "\n");
+
+        string rest, segment;
+        getline(words, rest);
+        istringstream chain(rest);
+        getline(chain, segment, '|');
+
+        string sourceName;
+        istringstream(segment) >> sourceName;
+        size_t current = this->lookup(sourceName);
+
+        while (getline(chain, segment, '|'))
+        {
+            segment.erase(0, segment.find_first_not_of(" \t"));
+            segment.erase(segment.find_last_not_of(" \t\r") + 1);
+
+            GraphStream stream;
+            stream.source = current;
+
+            istringstream command(segment);
+            string word, target;
+            u_int32_t start = 0;
+            command >> word >> target;
+
+            if (word == "mix" && target.starts_with("@"))
+            {
+                // A merge of two streams of the graph
+                if (!(command >> start))
+                    throw invalid_argument("Invalid parameters!\n");
+                stream.merge = this->lookup(target.substr(1));
+                stream.mergeStart = start;
+            }
+            else
+            {
+                // Any other command is parsed as a line of a config
+                command.clear();
+                command.seekg(0);
+                queue<Converter *> parsed = ParseConfigFile(string()).parsing(command, parseArgs);
+                if (parsed.size() != 1)
+                {
+                    while (!parsed.empty())
+                    {
+                        delete parsed.front();
+                        parsed.pop();
+                    }
+                    throw invalid_argument("Invalid graph command: " + segment + "\n");
+                }
+                stream.conv = parsed.front();
+
+                if (!stream.conv->isStreamable())
+                {
+                    delete stream.conv;
+                    throw invalid_argument("Command " + segment + " cannot run in a graph!\n");
+                }
+
+                // Such a converter reads its whole input first, only the input file is there to read
+                if (stream.conv->analyzesInput() && current != 0)
+                {
+                    delete stream.conv;
+                    throw invalid_argument("Command " + segment + " must take the input itself!\n");
+                }
+            }
+
+            this->streams.push_back(stream);
+            current = this->streams.size() - 1;
+        }
+
+        this->names[first] = current;
+        if (this->streams[current].name.empty())
+            this->streams[current].name = first;
+    }
+
+    if (this->outputs.empty())
+        throw invalid_argument("The graph has no outputs!\n");
+}
+
+void EffectGraph::pull(size_t index, bool final)
+{
+    // Takes the samples the sources of the stream have ready and appends the result
+    GraphStream &stream = this->streams[index];
+    const GraphStream &source = this->streams[stream.source];
+    u_int64_t end = source.bufferStart + source.buffer.size();
+    vector<int16_t> block;
+
+    if (stream.merge != SIZE_MAX)
+    {
+        // Stream position p is mixed with position p - mergeStart of the merged stream
+        const GraphStream &other = this->streams[stream.merge];
+        const u_int64_t otherEnd = other.bufferStart + other.buffer.size();
+        if (!other.finished)
+            end = min(end, otherEnd + stream.mergeStart);
+        end = max(end, stream.taken);
+
+        block.assign(source.buffer.begin() + (stream.taken - source.bufferStart),
+                     source.buffer.begin() + (end - source.bufferStart));
+
+        const u_int64_t begin = max(stream.taken, stream.mergeStart);
+        const u_int64_t last = min(end, otherEnd + stream.mergeStart);
+        for (u_int64_t p = begin; p < last; ++p)
+        {
+            int16_t &dst = block[p - stream.taken];
+            dst = (dst + other.buffer[p - stream.mergeStart - other.bufferStart]) / 2;
+        }
+        stream.taken = end;
+    }
+    else
+    {
+        block.assign(source.buffer.begin() + (stream.taken - source.bufferStart), source.buffer.end());
+        const u_int64_t size = block.size();
+        if (size > 0)
+            stream.conv->processBlock(block, stream.taken);
+        stream.taken += size;
+    }
+
+    stream.buffer.insert(stream.buffer.end(), block.begin(), block.end());
+
+    // Held back samples come out once the source has ended
+    if (final)
+    {
+        if (stream.conv)
+        {
+            stream.conv->flush(block);
+            stream.buffer.insert(stream.buffer.end(), block.begin(), block.end());
+        }
+        stream.finished = true;
+    }
+}
+
+void EffectGraph::trim(const vector<u_int64_t> &written)
+{
+    // Every stream keeps the samples from the earliest one a consumer still needs
+    vector<u_int64_t> needed(this->streams.size(), numeric_limits<u_int64_t>::max());
+    for (const GraphStream &stream : this->streams)
+    {
+        if (&stream == &this->streams[0])
+            continue;
+        needed[stream.source] = min(needed[stream.source], stream.taken);
+        if (stream.merge != SIZE_MAX)
+            needed[stream.merge] = min(needed[stream.merge], stream.taken - min(stream.taken, stream.mergeStart));
+    }
+    for (size_t i = 0; i < this->outputs.size(); ++i)
+        needed[this->outputs[i].first] = min(needed[this->outputs[i].first], written[i]);
+
+    for (size_t i = 0; i < this->streams.size(); ++i)
+    {
+        GraphStream &stream = this->streams[i];
+        const u_int64_t drop = min(needed[i] - min(needed[i], stream.bufferStart), (u_int64_t)stream.buffer.size());
+        stream.buffer.erase(stream.buffer.begin(), stream.buffer.begin() + drop);
+        stream.bufferStart += drop;
+    }
+}
+
+void EffectGraph::run(string inFileName, ReadWAV &reader, IOMode mode)
+{
+    // Logs the streams of the graph, the ones inside a chain by their number
+    auto label = [this](size_t i)
+    { return this->streams[i].name.empty() ? "#" + to_string(i) : this->streams[i].name; };
+
+    for (size_t i = 1; i < this->streams.size(); ++i)
+    {
+        const GraphStream &stream = this->streams[i];
+        cout << "graph: " << label(i) << " <- " << label(stream.source);
+        if (stream.merge != SIZE_MAX)
+            cout << " [mix @" << label(stream.merge) << " " << stream.mergeStart << "]";
+        else
+            cout << " [" << stream.conv->describe() << "]";
+        cout << endl;
+    }
+
+    for (size_t i = 1; i < this->streams.size(); ++i)
+        if (this->streams[i].conv && this->streams[i].conv->analyzesInput())
+            this->streams[i].conv->analyze(inFileName, reader);
+
+    reader.openWAVFile(inFileName);
+    reader.parseHead();
+    reader.checkCorrect();
+
+    for (GraphStream &stream : this->streams)
+        if (stream.conv)
+        {
+            stream.conv->useResampleQuality(reader.getResampleQuality());
+            stream.conv->prepare(reader.getSampleRate());
+        }
+
+    for (GraphStream &stream : this->streams)
+        stream.mergeStart *= reader.getSampleRate();
+
+    // Every output is written next to its place and renamed into it at the end
+    vector<unique_ptr<WriteWAV>> writers;
+    for (auto &[stream, name] : this->outputs)
+    {
+        if (fs::exists(name) && fs::equivalent(name, inFileName))
+            throw invalid_argument("Output " + name + " is the input!\n");
+
+        this->parts.push_back(name + ".part");
+        ofstream(this->parts.back(), ios::binary | ios::trunc).close();
+        writers.push_back(make_unique<WriteWAV>());
+        writers.back()->setIOMode(mode);
+        writers.back()->openWAVFile(this->parts.back());
+        writers.back()->writeHead(reader);
+    }
+
+    vector<u_int64_t> written(this->outputs.size(), 0);
+    auto step = [&](bool final)
+    {
+        // Streams only take from earlier ones, so one sweep in order moves every block through
+        for (size_t i = 1; i < this->streams.size(); ++i)
+            this->pull(i, final);
+
+        for (size_t i = 0; i < this->outputs.size(); ++i)
+        {
+            const GraphStream &stream = this->streams[this->outputs[i].first];
+            vector<int16_t> block(stream.buffer.begin() + (written[i] - stream.bufferStart), stream.buffer.end());
+            writers[i]->saveSamples(reader, block, 0);
+            written[i] += block.size();
+        }
+        this->trim(written);
+    };
+
+    GraphStream &input = this->streams[0];
+    vector<int16_t> samples;
+    while (reader.getSamples(samples, 0, reader.getSizeFile()))
+    {
+        input.buffer.insert(input.buffer.end(), samples.begin(), samples.end());
+        step(false);
+    }
+    input.finished = true;
+    step(true);
+
+    reader.closeWAVFile();
+    for (size_t i = 0; i < writers.size(); ++i)
+    {
+        writers[i]->closeWAVFile();
+        fs::rename(this->parts[i], this->outputs[i].second);
+        cout << "graph: wrote " << this->outputs[i].second << endl;
+    }
+    this->parts.clear();
+}
@@ -0,0 +1,253 @@
+#include "./sound_pr.hpp"
+
+// Implementation of IncrementalRender class methods
+
+IncrementalRender::IncrementalRender(string outFileName, fs::path workDir, bool fuse)
+{
+    this->outFileName = outFileName;
+    this->workDir = workDir;
+    this->fuse = fuse;
+    this->manifestName = outFileName + ".render";
+}
+
+string IncrementalRender::signature(Converter *conv)
+{
+    // Two commands are equal if their text and auxiliary files are
+    string text = conv->describe();
+    for (const string &aux : conv->auxFiles())
+        text += " " + StageCache::fileIdentity(aux);
+
+    return text;
+}
+
+vector<RenderedCommand> IncrementalRender::describeCommands(vector<Converter *> &stages, u_int32_t sampleRate)
+{
+    vector<RenderedCommand> commands;
+    for (Converter *conv : stages)
+    {
+        auto [begin, end] = conv->affectedRange(sampleRate);
+        commands.push_back({signature(conv), begin, end, conv->hasMemory()});
+    }
+
+    return commands;
+}
+
+bool IncrementalRender::loadManifest(string mainFileName, u_int32_t &sampleRate, vector<RenderedCommand> &commands)
+{
+    // Reads the manifest, it is only valid for the same input and an untouched output
+    ifstream fin(this->manifestName);
+    string line;
+
+    if (!getline(fin, line) || line != "sound_pr render 1")
+        return false;
+    if (!getline(fin, line) || line != "input " + StageCache::fileIdentity(mainFileName))
+        return false;
+    if (!getline(fin, line) || line != "output " + StageCache::fileIdentity(this->outFileName))
+        return false;
+
+    string word;
+    if (!(fin >> word >> sampleRate) || word != "rate")
+        return false;
+
+    RenderedCommand command;
+    while (fin >> word >> command.begin >> command.end >> command.memory)
+    {
+        if (word != "cmd")
+            return false;
+
+        getline(fin >> ws, command.signature);
+        commands.push_back(command);
+    }
+
+    return fin.eof();
+}
+
+void IncrementalRender::save(string mainFileName, vector<Converter *> &stages, u_int32_t sampleRate)
+{
+    // Records what the output was rendered from
+    ofstream fout(this->manifestName);
+    fout << "sound_pr render 1" << endl
+         << "input " << StageCache::fileIdentity(mainFileName) << endl
+         << "output " << StageCache::fileIdentity(this->outFileName) << endl
+         << "rate " << sampleRate << endl;
+
+    for (const RenderedCommand &command : describeCommands(stages, sampleRate))
+        fout << "cmd " << command.begin << " " << command.end << " " << command.memory << " "
+             << command.signature << endl;
+}
+
+vector<pair<u_int32_t, u_int32_t>> IncrementalRender::dirtyWindows(const vector<RenderedCommand> &old,
+                                                                   const vector<RenderedCommand> &cur,
+                                                                   u_int32_t sampleRate)
+{
+    // Commands outside the longest common subsequence of both lists were edited
+    const size_t n = old.size(), m = cur.size();
+    vector<vector<u_int32_t>> lcs(n + 1, vector<u_int32_t>(m + 1, 0));
+    for (size_t i = n; i-- > 0;)
+        for (size_t j = m; j-- > 0;)
+            lcs[i][j] = old[i].signature == cur[j].signature ? lcs[i + 1][j + 1] + 1
+                                                             : max(lcs[i + 1][j], lcs[i][j + 1]);
+
+    // Both the old and the new version of an edited command change their range,
+    // which is rounded out to whole seconds, the unit the converters work in
+    vector<pair<u_int32_t, u_int32_t>> windows;
+    auto addRange = [&](const RenderedCommand &command)
+    {
+        u_int32_t from = command.begin / sampleRate;
+        u_int32_t to = (command.end + sampleRate - 1) / sampleRate;
+        if (from < to)
+            windows.push_back({from, to});
+    };
+
+    size_t i = 0, j = 0;
+    while (i < n || j < m)
+    {
+        if (i < n && j < m && old[i].signature == cur[j].signature)
+        {
+            ++i;
+            ++j;
+        }
+        else if (j == m || (i < n && lcs[i + 1][j] >= lcs[i][j + 1]))
+            addRange(old[i++]);
+        else
+            addRange(cur[j++]);
+    }
+
+    // A command with memory spreads a change to the end of its range and can only be
+    // rendered from its start, so windows touching it grow to cover it entirely
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        sort(windows.begin(), windows.end());
+        vector<pair<u_int32_t, u_int32_t>> merged;
+        for (const auto &window : windows)
+        {
+            if (!merged.empty() && window.first <= merged.back().second)
+                merged.back().second = max(merged.back().second, window.second);
+            else
+                merged.push_back(window);
+        }
+        windows = merged;
+
+        for (const RenderedCommand &command : cur)
+        {
+            if (!command.memory)
+                continue;
+
+            u_int32_t from = command.begin / sampleRate;
+            u_int32_t to = (command.end + sampleRate - 1) / sampleRate;
+            for (auto &window : windows)
+            {
+                if (window.first < to && from < window.second && (from < window.first || window.second < to))
+                {
+                    window.first = min(window.first, from);
+                    window.second = max(window.second, to);
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    return windows;
+}
+
+void IncrementalRender::renderWindow(string mainFileName, u_int32_t from, u_int32_t to,
+                                     vector<Converter *> &stages, ReadWAV &reader, WriteWAV &writer)
+{
+    cout << "incremental: rendering " << from << " " << to << endl;
+
+    // Cut seconds [from, to) of the main file into a WAV file of its own
+    ReadWAV src_reader;
+    src_reader.setResampleQuality(reader.getResampleQuality());
+    src_reader.openWAVFile(mainFileName);
+    src_reader.parseHead();
+    src_reader.checkCorrect();
+
+    const u_int64_t sampleRate = src_reader.getSampleRate();
+    const u_int64_t count = min((u_int64_t)to * sampleRate, src_reader.getSampleCount()) - (u_int64_t)from * sampleRate;
+
+    WAVHeader header = *src_reader.getHeader();
+    header.subchunk2Size = count * sizeof(int16_t);
+    header.chunkSize = sizeof(WAVHeader) - 8 + header.subchunk2Size;
+
+    pair<string, string> names{this->workDir / "tmp1.wav", this->workDir / "tmp2.wav"};
+    ofstream fout(names.first, ios::binary | ios::trunc);
+    fout.write((const char *)&header, sizeof(WAVHeader));
+
+    vector<int16_t> samples;
+    samples.reserve(src_reader.getUnitSize());
+    while (src_reader.getSamples(samples, from, to))
+        fout.write((const char *)samples.data(), samples.size() * sizeof(int16_t));
+
+    fout.close();
+    src_reader.closeWAVFile();
+
+    // Apply the commands restricted to the window
+    vector<Converter *> windowed;
+    for (Converter *stage : stages)
+        if (Converter *conv = stage->window(from, to))
+            windowed.push_back(conv);
+
+    for (auto group : StreamPass::plan(windowed, 0, this->fuse))
+    {
+        StreamPass::runGroup(windowed, group, names.first, names.second, reader, writer);
+        swap(names.first, names.second);
+    }
+
+    for (Converter *conv : windowed)
+        delete conv;
+
+    // Write the result over the same seconds of the existing output
+    ReadWAV part_reader;
+    part_reader.openWAVFile(names.first);
+    part_reader.parseHead();
+    writer.openWAVFile(this->outFileName);
+
+    while (part_reader.getSamples(samples, 0, to - from))
+        writer.saveSamples(part_reader, samples, from);
+
+    writer.closeWAVFile();
+    part_reader.closeWAVFile();
+
+    fs::remove(names.first);
+    fs::remove(names.second);
+}
+
+bool IncrementalRender::update(string mainFileName, vector<Converter *> &stages, ReadWAV &reader, WriteWAV &writer)
+{
+    // Returns false if there is no previous render to update and the whole file has to be processed
+    u_int32_t sampleRate = 0;
+    vector<RenderedCommand> old;
+    if (!fs::exists(this->outFileName) || !this->loadManifest(mainFileName, sampleRate, old))
+        return false;
+
+    ReadWAV src_reader;
+    src_reader.setResampleQuality(reader.getResampleQuality());
+    src_reader.openWAVFile(mainFileName);
+    src_reader.parseHead();
+    src_reader.checkCorrect();
+    src_reader.closeWAVFile();
+
+    if (src_reader.getSampleRate() != sampleRate)
+        return false;
+
+    vector<RenderedCommand> cur = describeCommands(stages, sampleRate);
+    vector<pair<u_int32_t, u_int32_t>> windows = this->dirtyWindows(old, cur, sampleRate);
+
+    u_int32_t rendered = 0;
+    const u_int32_t duration = src_reader.getSizeFile();
+    for (auto [from, to] : windows)
+    {
+        to = min(to, duration);
+        if (from >= to)
+            continue;
+
+        this->renderWindow(mainFileName, from, to, stages, reader, writer);
+        rendered += to - from;
+    }
+
+    cout << "incremental: re-rendered " << rendered << " of " << duration << " seconds" << endl;
+    return true;
+}
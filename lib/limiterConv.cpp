@@ -0,0 +1,222 @@
+#include "./sound_pr.hpp"
+
+// Constructor for the Limiter class, times are converted to samples in prepare()
+Limiter::Limiter(double ceilingDb, double lookaheadMs, double attackMs, double releaseMs)
+{
+    this->ceilingDb = ceilingDb;
+    this->lookaheadMs = lookaheadMs;
+    this->attackMs = attackMs;
+    this->releaseMs = releaseMs;
+}
+
+void Limiter::prepare(u_int32_t sampleRate)
+{
+    this->ceiling = INT16_MAX * pow(10.0, this->ceilingDb / 20.0);
+    this->lookahead = max(1u, (u_int32_t)(this->lookaheadMs * sampleRate / 1000.0));
+    this->attack = min(max(1u, (u_int32_t)(this->attackMs * sampleRate / 1000.0)), this->lookahead + 1);
+    this->releaseCoef = exp(-1000.0 / (this->releaseMs * sampleRate));
+
+    // Windowed sinc interpolating sample n + p / phases from samples n - 3 .. n + 4
+    for (int p = 0; p < phases; ++p)
+    {
+        double sum = 0.0;
+        for (int j = 0; j < taps; ++j)
+        {
+            double x = (j - (taps / 2 - 1)) - (double)p / phases;
+            double sinc = x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+            this->interp[p][j] = sinc * (0.5 + 0.5 * cos(M_PI * x / (taps / 2 + 0.5)));
+            sum += this->interp[p][j];
+        }
+        for (int j = 0; j < taps; ++j)
+            this->interp[p][j] /= sum;
+    }
+
+    // The stream is preceded by silence, which is the context of its first samples
+    this->audio.assign(taps / 2 - 1, 0);
+    this->audioStart = -(taps / 2 - 1);
+    this->nextDetect = 0;
+    this->nextOut = 0;
+
+    this->minQueue.assign(this->lookahead + 2, {0, 1.0});
+    this->head = this->tail = 0;
+
+    this->held.assign(this->attack, 1.0);
+    this->heldPos = 0;
+    this->heldSum = this->attack;
+    this->gain = 1.0;
+}
+
+u_int32_t Limiter::latency()
+{
+    // The lookahead plus the samples the interpolation needs after the current one
+    return this->lookahead + taps / 2;
+}
+
+double Limiter::requiredGain(int64_t index)
+{
+    // Gain that brings the true peak around sample index down to the ceiling
+    const int16_t *x = this->audio.data() + (index - this->audioStart - (taps / 2 - 1));
+    double peak = abs((double)x[taps / 2 - 1]);
+
+    for (int p = 1; p < phases; ++p)
+    {
+        double y = 0.0;
+        for (int j = 0; j < taps; ++j)
+            y += this->interp[p][j] * x[j];
+        peak = max(peak, abs(y));
+    }
+
+    return peak > this->ceiling ? this->ceiling / peak : 1.0;
+}
+
+void Limiter::processBlock(vector<int16_t> &samples, u_int64_t)
+{
+    this->audio.insert(this->audio.end(), samples.begin(), samples.end());
+    const int64_t available = this->audioStart + (int64_t)this->audio.size();
+    const size_t capacity = this->minQueue.size();
+
+    // Gain computation, sample by sample: output o needs the required gain up to o + lookahead
+    this->gains.clear();
+    for (int64_t o = this->nextOut; o + this->lookahead + taps / 2 < available; ++o)
+    {
+        for (; this->nextDetect <= o + this->lookahead; ++this->nextDetect)
+        {
+            double required = this->requiredGain(this->nextDetect);
+            while (this->head != this->tail &&
+                   this->minQueue[(this->tail + capacity - 1) % capacity].second >= required)
+                this->tail = (this->tail + capacity - 1) % capacity;
+
+            this->minQueue[this->tail] = {this->nextDetect, required};
+            this->tail = (this->tail + 1) % capacity;
+        }
+
+        while (this->minQueue[this->head].first < o)
+            this->head = (this->head + 1) % capacity;
+
+        // Moving average of the held minimum over the attack time
+        this->heldSum += this->minQueue[this->head].second - this->held[this->heldPos];
+        this->held[this->heldPos] = this->minQueue[this->head].second;
+        this->heldPos = (this->heldPos + 1) % this->attack;
+        double target = this->heldSum / this->attack;
+
+        // Falling gain follows at once, rising gain recovers over the release time
+        this->gain = target < this->gain ? target : target + (this->gain - target) * this->releaseCoef;
+        this->gains.push_back(this->gain);
+    }
+
+    // Gain application over the whole block, with a hard clip at the ceiling as a backstop
+    const size_t count = this->gains.size();
+    const int16_t *x = this->audio.data() + (this->nextOut - this->audioStart);
+    const double limit = floor(this->ceiling);
+    samples.resize(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        double y = max(min(x[i] * this->gains[i], limit), -limit);
+        samples[i] = (int16_t)(y + (y < 0 ? -0.5 : 0.5));
+    }
+    this->nextOut += count;
+
+    // Keep the samples not yet written and the interpolation context before them
+    int64_t keep = this->nextOut - (taps / 2 - 1);
+    this->audio.erase(this->audio.begin(), this->audio.begin() + (keep - this->audioStart));
+    this->audioStart = keep;
+}
+
+void Limiter::flush(vector<int16_t> &samples)
+{
+    // Silence after the end pushes the held back samples out
+    samples.assign(this->latency(), 0);
+    this->processBlock(samples, 0);
+}
+
+void Limiter::saveState(ostream &out)
+{
+    writeRaw(out, this->audio);
+    writeRaw(out, this->audioStart);
+    writeRaw(out, this->nextDetect);
+    writeRaw(out, this->nextOut);
+    writeRaw(out, this->minQueue);
+    writeRaw(out, this->head);
+    writeRaw(out, this->tail);
+    writeRaw(out, this->held);
+    writeRaw(out, this->heldPos);
+    writeRaw(out, this->heldSum);
+    writeRaw(out, this->gain);
+}
+
+void Limiter::loadState(istream &in)
+{
+    readRaw(in, this->audio);
+    readRaw(in, this->audioStart);
+    readRaw(in, this->nextDetect);
+    readRaw(in, this->nextOut);
+    readRaw(in, this->minQueue);
+    readRaw(in, this->head);
+    readRaw(in, this->tail);
+    readRaw(in, this->held);
+    readRaw(in, this->heldPos);
+    readRaw(in, this->heldSum);
+    readRaw(in, this->gain);
+}
+
+u_int64_t Limiter::memoryUse(u_int32_t sampleRate, size_t count)
+{
+    // The input over the lookahead and a block, the gain queue and average, the gains of a block
+    const u_int64_t lookahead = max(1u, (u_int32_t)(this->lookaheadMs * sampleRate / 1000.0));
+    const u_int64_t attack = min(max(1u, (u_int32_t)(this->attackMs * sampleRate / 1000.0)), (u_int32_t)lookahead + 1);
+    return (lookahead + count + taps) * sizeof(int16_t) + (lookahead + 2) * sizeof(pair<int64_t, double>) +
+           attack * sizeof(double) + count * sizeof(double);
+}
+
+void Limiter::convert(string inFileName, string outFileName, ReadWAV &reader, WriteWAV &writer)
+{
+    // On its own the limiter is a pass with a single member
+    StreamPass pass;
+    pass.add(this);
+    pass.run(inFileName, outFileName, reader, writer);
+}
+
+string Limiter::describe()
+{
+    ostringstream out;
+    out << setprecision(17) << "limiter " << this->ceilingDb << " " << this->lookaheadMs << " "
+        << this->attackMs << " " << this->releaseMs;
+    return out.str();
+}
+
+pair<u_int64_t, u_int64_t> Limiter::affectedRange(u_int32_t sampleRate)
+{
+    // The limiter works on the whole stream
+    return {0, (u_int64_t)numeric_limits<u_int32_t>::max() * sampleRate};
+}
+
+bool Limiter::hasMemory()
+{
+    return true;
+}
+
+Converter *Limiter::window(u_int32_t from, u_int32_t)
+{
+    // The gain recovers slowly after every peak, so it depends on the stream from the start
+    if (from != 0)
+        throw logic_error("Limiter window must include the start of the stream!\n");
+
+    return new Limiter(this->ceilingDb, this->lookaheadMs, this->attackMs, this->releaseMs);
+}
+
+void Limiter::help()
+{
+    cout << "\033[33m   Limiter\033[0m" << endl
+         << "Keeps the true peak of the sound under <c> dBFS, looking <l> ms ahead," << endl
+         << "lowering the gain over <a> ms (at most <l>) and restoring it over <r> ms" << endl
+         << "limiter <c> <l> <a> <r>, put it last so that nothing clips after it" << endl
+         << "Example: limiter -1 5 2 100" << endl
+         << endl;
+}
+
+// Factory method for creating Limiter converters
+Converter *LimiterCreater::creatConverter(double ceilingDb, double lookaheadMs, double attackMs, double releaseMs)
+{
+    Limiter *limiter = new Limiter(ceilingDb, lookaheadMs, attackMs, releaseMs);
+    return limiter;
+}
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "./sound_pr.hpp"
+
+// Implementation of MemoryBudget class methods
+
+MemoryBudget &MemoryBudget::global()
+{
+    static MemoryBudget budget;
+    return budget;
+}
+
+void MemoryBudget::setLimit(u_int64_t limit)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->limit = limit;
+    this->released.notify_all();
+}
+
+u_int64_t MemoryBudget::getLimit()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->limit;
+}
+
+u_int64_t MemoryBudget::getUsed()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->used;
+}
+
+u_int64_t MemoryBudget::getPeak()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->peak;
+}
+
+size_t MemoryBudget::getWaiting()
+{
+    lock_guard<mutex> guard(this->lock);
+    return this->waiting;
+}
+
+void MemoryBudget::charge(u_int64_t bytes)
+{
+    lock_guard<mutex> guard(this->lock);
+    this->used += bytes;
+    this->peak = max(this->peak, this->used);
+}
+
+void MemoryBudget::release(u_int64_t bytes)
+{
+    // Jobs waiting for memory look again whenever some is given back
+    lock_guard<mutex> guard(this->lock);
+    this->used -= min(bytes, this->used);
+    this->released.notify_all();
+}
+
+u_int64_t MemoryBudget::available()
+{
+    lock_guard<mutex> guard(this->lock);
+    if (this->limit == 0)
+        return numeric_limits<u_int64_t>::max();
+    return this->limit > this->used ? this->limit - this->used : 0;
+}
+
+string MemoryBudget::report()
+{
+    lock_guard<mutex> guard(this->lock);
+    ostringstream out;
+    out << fixed << setprecision(1) << "peak " << this->peak / 1048576.0 << " MB";
+    if (this->limit > 0)
+        out << " of the " << this->limit / 1048576.0 << " MB limit, " << this->waited
+            << " jobs waited for memory";
+    return out.str();
+}
+
+// Implementation of MemoryLease class methods
+
+MemoryLease::~MemoryLease()
+{
+    MemoryBudget &budget = MemoryBudget::global();
+    if (this->job)
+    {
+        lock_guard<mutex> guard(budget.lock);
+        --budget.jobs;
+    }
+    budget.release(this->bytes);
+}
+
+void MemoryLease::resize(u_int64_t bytes)
+{
+    if (bytes > this->bytes)
+        MemoryBudget::global().charge(bytes - this->bytes);
+    else if (bytes < this->bytes)
+        MemoryBudget::global().release(this->bytes - bytes);
+    this->bytes = bytes;
+}
+
+bool MemoryLease::tryResize(u_int64_t bytes)
+{
+    if (bytes <= this->bytes)
+    {
+        this->resize(bytes);
+        return true;
+    }
+
+    // Checked and charged under one lock, so two passes cannot both take the last free bytes
+    MemoryBudget &budget = MemoryBudget::global();
+    {
+        lock_guard<mutex> guard(budget.lock);
+        if (budget.limit == 0 || budget.used - this->bytes + bytes <= budget.limit)
+        {
+            budget.used = budget.used - this->bytes + bytes;
+            budget.peak = max(budget.peak, budget.used);
+            this->bytes = bytes;
+            return true;
+        }
+    }
+    return false;
+}
+
+u_int64_t MemoryLease::size()
+{
+    return this->bytes;
+}
+
+bool MemoryLease::admit(u_int64_t bytes, const atomic<bool> *cancelled)
+{
+    // The first job always goes in, so a job larger than the limit runs alone instead of never
+    MemoryBudget &budget = MemoryBudget::global();
+    unique_lock<mutex> guard(budget.lock);
+    auto fits = [&]()
+    { return budget.limit == 0 || budget.jobs == 0 || budget.used + bytes <= budget.limit; };
+
+    if (!fits())
+    {
+        ++budget.waiting;
+        ++budget.waited;
+        while (!fits() && !(cancelled && cancelled->load()))
+            budget.released.wait_for(guard, chrono::milliseconds(100));
+        --budget.waiting;
+        if (cancelled && cancelled->load())
+            return false;
+    }
+
+    ++budget.jobs;
+    budget.used += bytes;
+    budget.peak = max(budget.peak, budget.used);
+    this->job = true;
+    this->bytes += bytes;
+    return true;
+}
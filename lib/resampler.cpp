@@ -0,0 +1,224 @@
+#include "./sound_pr.hpp"
+#include <numeric>
+
+// The prototype low-pass filters of the presets are computed by the compiler: a sinc
+// with its cutoff at rolloff times Nyquist under a Kaiser window, sampled at Steps points
+// per zero crossing on one side, from 0 to Zeros crossings
+
+static constexpr double pi = 3.14159265358979323846;
+
+static constexpr double constSin(double x)
+{
+    // Reduced to [-pi, pi], then the Taylor series
+    x -= 2 * pi * (double)(long long)(x / (2 * pi));
+    if (x > pi)
+        x -= 2 * pi;
+    else if (x < -pi)
+        x += 2 * pi;
+
+    double term = x, sum = x;
+    for (int k = 1; term != 0 && sum + term != sum; ++k)
+    {
+        term *= -x * x / ((2 * k) * (2 * k + 1));
+        sum += term;
+    }
+    return sum;
+}
+
+static constexpr double constSqrt(double x)
+{
+    // Newton from above goes down until it stops
+    if (x <= 0)
+        return 0;
+    double root = x > 1 ? x : 1, last = 0;
+    while (root != last)
+    {
+        last = root;
+        root = (root + x / root) / 2;
+        if (root >= last)
+            break;
+    }
+    return root;
+}
+
+static constexpr double besselI0(double x)
+{
+    double term = 1, sum = 1;
+    for (int k = 1; sum + term != sum; ++k)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+template <size_t Zeros, size_t Steps>
+struct Kernel
+{
+    static constexpr size_t zeros = Zeros;
+    array<float, Zeros * Steps + 1> values{};
+
+    constexpr Kernel(double rolloff, double beta)
+    {
+        // The sine goes from step to step by the angle sum formulas, which keeps the
+        // compiler well within its budget for the longest kernel
+        const double norm = besselI0(beta);
+        const double stepSin = constSin(pi * rolloff / Steps), stepCos = constSin(pi * rolloff / Steps + pi / 2);
+        double sine = 0, cosine = 1;
+        for (size_t i = 0; i <= Zeros * Steps; ++i)
+        {
+            const double x = (double)i / Steps;
+            const double sinc = i == 0 ? rolloff : sine / (pi * x);
+            const double edge = x / Zeros;
+            this->values[i] = (float)(sinc * besselI0(beta * constSqrt(1 - edge * edge)) / norm);
+
+            const double nextSine = sine * stepCos + cosine * stepSin;
+            cosine = cosine * stepCos - sine * stepSin;
+            sine = nextSine;
+        }
+    }
+
+    // The kernel at x, linear between the steps, zero outside
+    double at(double x) const
+    {
+        x = fabs(x) * Steps;
+        if (x >= Zeros * Steps)
+            return 0;
+        const size_t i = (size_t)x;
+        const double frac = x - i;
+        return this->values[i] + frac * (this->values[i + 1] - this->values[i]);
+    }
+};
+
+static constexpr Kernel<16, 128> fastKernel(0.85, 6.0);
+static constexpr Kernel<32, 256> mediumKernel(0.91, 8.6);
+static constexpr Kernel<64, 256> bestKernel(0.945, 10.5);
+
+// Implementation of Resampler class methods
+
+Resampler::Resampler(u_int32_t from, u_int32_t to, ResampleQuality quality)
+{
+    const u_int64_t common = gcd(from, to);
+    this->up = to / common;
+    this->down = from / common;
+    this->phases = min(this->up, maxPhases);
+
+    // Going down the cutoff follows the new Nyquist, and the kernel widens as much
+    const double scale = min(1.0, (double)this->up / this->down);
+    auto build = [&](const auto &kernel)
+    {
+        // The taps come in whole eights, the ones past the kernel stay zero
+        this->taps = ((size_t)ceil(2 * kernel.zeros / scale) + 7) / 8 * 8;
+        const size_t half = this->taps / 2;
+        this->bank.assign(this->phases * this->taps, 0.0f);
+
+        // Tap j of row p takes input sample base - half + 1 + j for an output at base + p / phases
+        for (u_int64_t p = 0; p < this->phases; ++p)
+        {
+            float *row = this->bank.data() + p * this->taps;
+            double sum = 0;
+            for (size_t j = 0; j < this->taps; ++j)
+            {
+                const double distance = (double)p / this->phases + half - 1 - (double)j;
+                row[j] = (float)(scale * kernel.at(scale * distance));
+                sum += row[j];
+            }
+
+            // Every row passes a constant as it is, so no phase is louder than another
+            for (size_t j = 0; j < this->taps; ++j)
+                row[j] = (float)(row[j] / sum);
+        }
+    };
+
+    if (quality == ResampleQuality::Fast)
+        build(fastKernel);
+    else if (quality == ResampleQuality::Medium)
+        build(mediumKernel);
+    else
+        build(bestKernel);
+
+    this->start(0);
+}
+
+u_int64_t Resampler::outputLength(u_int64_t count)
+{
+    return (count * this->up + this->down - 1) / this->down;
+}
+
+u_int64_t Resampler::start(u_int64_t n)
+{
+    // The window of output n begins half the taps before its base input sample
+    this->next = n;
+    this->ended = false;
+    this->historyStart = (int64_t)(n * this->down / this->up) - (int64_t)this->taps / 2 + 1;
+    this->history.assign(this->historyStart < 0 ? -this->historyStart : 0, 0.0f);
+    return max<int64_t>(this->historyStart, 0);
+}
+
+void Resampler::push(const int16_t *samples, size_t count)
+{
+    this->history.insert(this->history.end(), samples, samples + count);
+}
+
+void Resampler::finish()
+{
+    this->ended = true;
+}
+
+size_t Resampler::pull(int16_t *out, size_t count)
+{
+    const size_t half = this->taps / 2;
+    size_t made = 0;
+    for (; made < count; ++made)
+    {
+        const u_int64_t time = this->next * this->down;
+        int64_t base = time / this->up;
+        u_int64_t row = time % this->up;
+        if (this->phases < this->up)
+        {
+            // The nearest row, the last one rounds up to the first of the next sample
+            row = (row * this->phases * 2 + this->up) / (this->up * 2);
+            if (row == this->phases)
+            {
+                row = 0;
+                ++base;
+            }
+        }
+
+        const int64_t first = base - (int64_t)half + 1 - this->historyStart;
+        if (first + this->taps > this->history.size())
+        {
+            if (!this->ended)
+                break;
+            this->history.resize(first + this->taps, 0.0f);
+        }
+
+        // Eight sums side by side, so the compiler can keep them in vector registers
+        const float *x = this->history.data() + first;
+        const float *c = this->bank.data() + row * this->taps;
+        float sums[8] = {};
+        for (size_t j = 0; j < this->taps; j += 8)
+            for (size_t k = 0; k < 8; ++k)
+                sums[k] += c[j + k] * x[j + k];
+        const float sum = ((sums[0] + sums[4]) + (sums[1] + sums[5])) + ((sums[2] + sums[6]) + (sums[3] + sums[7]));
+
+        out[made] = (int16_t)max(min(lrintf(sum), (long)INT16_MAX), (long)INT16_MIN);
+        ++this->next;
+    }
+
+    // The input before the window of the next output is not needed again
+    const int64_t keep = (int64_t)(this->next * this->down / this->up) - (int64_t)half - this->historyStart;
+    if (keep > (int64_t)this->history.size() / 2 && keep > 0)
+    {
+        const size_t drop = min((size_t)keep, this->history.size());
+        this->history.erase(this->history.begin(), this->history.begin() + drop);
+        this->historyStart += drop;
+    }
+    return made;
+}
+
+u_int64_t Resampler::memoryUse(size_t count)
+{
+    // The history holds up to twice what is pushed at a time before it is trimmed
+    return (this->bank.size() + 2 * (count + this->taps)) * sizeof(float);
+}
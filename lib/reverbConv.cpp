@@ -35,20 +35,21 @@ void Reverberation::convert(string inFileName, string outFileName, ReadWAV &read
     samples.reserve(reader.getUnitSize());
     delayedSamples.resize(delaySamples, 0);
 
-    // Process the reverberation effect
-    while (reader.getSamples(samples, this->left, this->right))
+    // Process the reverberation effect, the delay line runs on across the units read
+    size_t index = 0;
+    while (delaySamples > 0 && reader.getSamples(samples, this->left, this->right))
     {
-        for (size_t i = 0; i < samples.size(); ++i)
+        for (size_t i = 0; i < samples.size(); ++i, index = (index + 1) % delaySamples)
         {
             int16_t original = samples[i];
-            int16_t delayed = delayedSamples[i % delaySamples];
-            int16_t newSample = static_cast<int16_t>(original + this->koeff * delayed);
+            int16_t delayed = delayedSamples[index];
+            double newSample = original + this->koeff * delayed;
 
-            // Clamp the new sample to the valid range
-            samples[i] = max(min(newSample, static_cast<int16_t>(INT16_MAX)), static_cast<int16_t>(INT16_MIN));
+            // Clamp the new sample to the valid range before it is narrowed to 16 bits
+            samples[i] = static_cast<int16_t>(max(min(newSample, (double)INT16_MAX), (double)INT16_MIN));
 
             // Update the delayed samples buffer
-            delayedSamples[i % delaySamples] = samples[i];
+            delayedSamples[index] = samples[i];
         }
 
         writer.saveSamples(reader, samples, this->left);
@@ -59,6 +60,97 @@ void Reverberation::convert(string inFileName, string outFileName, ReadWAV &read
     writer.closeWAVFile();
 }
 
+string Reverberation::describe()
+{
+    // Full precision keeps distinct coefficients apart in cache keys
+    ostringstream out;
+    out << setprecision(17) << "reverberation " << this->left << " " << this->right << " " << this->koeff;
+    return out.str();
+}
+
+pair<u_int64_t, u_int64_t> Reverberation::affectedRange(u_int32_t sampleRate)
+{
+    // The echo is cut off at the right border, so the tail never leaves [left, right)
+    return {(u_int64_t)this->left * sampleRate, (u_int64_t)this->right * sampleRate};
+}
+
+bool Reverberation::hasMemory()
+{
+    // Every output sample depends on the input since left through the delay line
+    return true;
+}
+
+Converter *Reverberation::window(u_int32_t from, u_int32_t to)
+{
+    if (this->right <= from || this->left >= to)
+        return nullptr;
+
+    // The delay line starts empty at left, so a window must not cut the effect on the left side
+    if (this->left < from)
+        throw logic_error("Reverberation window must include the start of the effect!\n");
+
+    return new Reverberation(this->left - from, min(this->right, to) - from, this->koeff);
+}
+
+void Reverberation::prepare(u_int32_t sampleRate)
+{
+    // The delay line starts empty at left
+    this->sampleRate = sampleRate;
+    this->delayedSamples.assign((size_t)(this->koeff * sampleRate), 0);
+    this->audible = 0;
+}
+
+void Reverberation::processBlock(vector<int16_t> &samples, u_int64_t pos)
+{
+    const u_int64_t start = (u_int64_t)this->left * this->sampleRate;
+    const u_int64_t begin = max(pos, start);
+    const u_int64_t end = min(pos + samples.size(), (u_int64_t)this->right * this->sampleRate);
+    const size_t delaySamples = this->delayedSamples.size();
+    if (begin >= end || delaySamples == 0)
+        return;
+
+    size_t index = (begin - start) % delaySamples;
+    for (u_int64_t p = begin; p < end; ++p, index = (index + 1) % delaySamples)
+    {
+        int16_t original = samples[p - pos];
+        int16_t delayed = this->delayedSamples[index];
+        double newSample = original + this->koeff * delayed;
+
+        // Clamp the new sample to the valid range before it is narrowed to 16 bits
+        samples[p - pos] = static_cast<int16_t>(max(min(newSample, (double)INT16_MAX), (double)INT16_MIN));
+
+        // Update the delayed samples buffer
+        this->audible += (samples[p - pos] != 0) - (delayed != 0);
+        this->delayedSamples[index] = samples[p - pos];
+    }
+}
+
+bool Reverberation::processSilence(u_int64_t pos, size_t count)
+{
+    // Outside its range, or once the echo has died out, silence goes through unchanged
+    const u_int64_t begin = max(pos, (u_int64_t)this->left * this->sampleRate);
+    const u_int64_t end = min(pos + count, (u_int64_t)this->right * this->sampleRate);
+    if (begin >= end)
+        return true;
+    return this->audible == 0;
+}
+
+void Reverberation::saveState(ostream &out)
+{
+    writeRaw(out, this->delayedSamples);
+}
+
+void Reverberation::loadState(istream &in)
+{
+    readRaw(in, this->delayedSamples);
+    this->audible = this->delayedSamples.size() - count(this->delayedSamples.begin(), this->delayedSamples.end(), 0);
+}
+
+u_int64_t Reverberation::memoryUse(u_int32_t sampleRate, size_t)
+{
+    return (u_int64_t)(this->koeff * sampleRate) * sizeof(int16_t);
+}
+
 void Reverberation::help()
 {
     cout << "\033[33m   The reverb\033[0m" << endl
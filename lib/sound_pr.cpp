@@ -1,4 +1,35 @@
 #include "./sound_pr.hpp"
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <cstring>
+#include <sys/file.h>
+
+// In the NoCache mode pages are dropped and written back in steps of this many bytes
+static const u_int64_t pacingChunk = 8 << 20;
+
+// Holes are punched in whole file system blocks, and only for runs of zeros this long
+static const u_int64_t holeBlock = 4096;
+static const u_int64_t minHole = 64 << 10;
+bool isSilent(const vector<int16_t> &samples)
+{
+    // An OR over every chunk, so that a loud block is given up on early
+    const int16_t *data = samples.data();
+    const size_t size = samples.size();
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64)
+    {
+        int16_t any = 0;
+        for (size_t j = 0; j < 64; ++j)
+            any |= data[i + j];
+        if (any)
+            return false;
+    }
+    for (; i < size; ++i)
+        if (data[i])
+            return false;
+    return true;
+}
+
 // Implementation of ReadWAV class methods
 
 int ReadWAV::getUnitSize()
@@ -6,6 +37,20 @@ int ReadWAV::getUnitSize()
     return this->sizeOfUnit; // Returns the size of a data unit
 }
 
+void ReadWAV::setUnitSize(int size)
+{
+    this->sizeOfUnit = size;
+}
+
+u_int64_t ReadWAV::memoryUse(size_t count)
+{
+    // A converted file is read count samples of the file at a time as well
+    u_int64_t bytes = this->direct.memoryUse();
+    if (this->resampler)
+        bytes += this->resampler->memoryUse(count) + count * sizeof(int16_t);
+    return bytes;
+}
+
 bool ReadWAV::openWAVFile(string inputFileName)
 {
     // Open the WAV file and verify the path is correct
@@ -14,6 +59,18 @@ bool ReadWAV::openWAVFile(string inputFileName)
     if (!file.is_open())
         throw runtime_error("Failed to open the file. Please check the file name or path.\n");
 
+    // The header always goes through the stream, the samples as the mode says
+    this->active = this->mode;
+    this->advised = 0;
+    if (this->active == IOMode::Direct && !this->direct.open(this->inputFileName, false))
+    {
+        cout << "io: no O_DIRECT for " << this->inputFileName << ", dropping cached pages instead" << endl;
+        this->active = IOMode::NoCache;
+    }
+    if (this->active != IOMode::Direct)
+        this->sideFd = open(this->inputFileName.c_str(), O_RDONLY);
+    this->regionStart = this->regionEnd = 0;
+
     return this->file.is_open();
 }
 
@@ -21,6 +78,15 @@ bool ReadWAV::closeWAVFile()
 {
     // Closes the WAV file
     this->file.close();
+    this->direct.close();
+    if (this->sideFd >= 0)
+    {
+        // Whatever is still cached of the file goes as well
+        if (this->active == IOMode::NoCache)
+            posix_fadvise(this->sideFd, 0, 0, POSIX_FADV_DONTNEED);
+        close(this->sideFd);
+        this->sideFd = -1;
+    }
     return !this->file.is_open();
 }
 
@@ -29,17 +95,35 @@ void ReadWAV::parseHead()
     // Reads the WAV file header and fills the struct
     this->header = new WAVHeader;
     file.read((char *)this->header, sizeof(WAVHeader));
+    this->position = sizeof(WAVHeader);
+
+    // A mono 16 bit file at another rate is seen as the stream it converts to
+    this->fileHeader = *this->header;
+    this->resampler.reset();
+    const u_int32_t rate = this->header->sampleRate;
+    if (this->header->audioFormat == 1 && this->header->numChannels == 1 && this->header->bitsPerSample == 16 &&
+        rate != pipelineRate && rate >= 8000 && rate <= 384000)
+    {
+        this->resampler = make_unique<Resampler>(rate, pipelineRate, this->quality);
+        const u_int64_t count = this->resampler->outputLength(this->header->subchunk2Size / sizeof(int16_t));
+        this->header->sampleRate = pipelineRate;
+        this->header->byteRate = pipelineRate * sizeof(int16_t);
+        this->header->subchunk2Size = (u_int32_t)min(count * sizeof(int16_t), (u_int64_t)UINT32_MAX - sizeof(WAVHeader));
+        this->header->chunkSize = sizeof(WAVHeader) - 8 + this->header->subchunk2Size;
+        this->outPos = 0;
+    }
 }
 
 bool ReadWAV::checkCorrect()
 {
     // Validates that the file is a proper WAV format with specific properties
+    const WAVHeader *header = &this->fileHeader;
     if (string(header->chunkID, 4) != "RIFF" || string(header->format, 4) != "WAVE")
         throw runtime_error("The file is not a valid WAV format!\n");
 
-    else if (!((header->audioFormat == 1) && (header->numChannels == 1) &&
-               (header->sampleRate == 44100) && (header->bitsPerSample == 16)))
-        throw runtime_error("This program supports only PCM, mono audio, 16 bit, sampling rate 44100!\n");
+    else if (!((header->audioFormat == 1) && (header->numChannels == 1) && (header->bitsPerSample == 16) &&
+               (header->sampleRate >= 8000) && (header->sampleRate <= 384000)))
+        throw runtime_error("This program supports only PCM, mono audio, 16 bit, sampling rate 8000 to 384000!\n");
 
     else
         return true;
@@ -48,21 +132,30 @@ bool ReadWAV::checkCorrect()
 bool ReadWAV::getSamples(vector<int16_t> &samples, int sec_st, int sec_end)
 {
     // Reads a portion of audio samples from the WAV file
+    if (this->cancelled && this->cancelled->load())
+        throw runtime_error("The job was cancelled!\n");
+    if (this->resampler)
+        return this->getConverted(samples, sec_st, sec_end);
+
     u_int64_t offset = 2 * (u_int64_t)header->sampleRate * (u_int64_t)sec_st + (u_int64_t)sizeof(WAVHeader);
-    streampos currentPos = file.tellg();
+    int64_t currentPos = this->tell();
 
-    if (currentPos <= offset)
+    if (currentPos <= (int64_t)offset)
     {
-        this->file.seekg(offset, ios::beg);
-        this->remainingDataSize = (u_int64_t)(sec_end - sec_st) * (u_int64_t)header->sampleRate;
+        this->seek(offset);
+        // Never read past the end of the data chunk
+        u_int64_t first = min((u_int64_t)header->sampleRate * (u_int64_t)sec_st, this->getSampleCount());
+        this->remainingDataSize = min((u_int64_t)(sec_end - sec_st) * (u_int64_t)header->sampleRate,
+                                      this->getSampleCount() - first);
     }
 
     if (this->remainingDataSize > 0)
     {
         size_t bytesToRead = min((u_int64_t)this->getUnitSize(), this->remainingDataSize);
         samples.resize(bytesToRead);
-        file.read((char *)samples.data(), bytesToRead * sizeof(int16_t));
+        this->readData((char *)samples.data(), bytesToRead * sizeof(int16_t));
         this->remainingDataSize -= bytesToRead;
+        this->lastBlockSilent = this->lastBlockHole || isSilent(samples);
         return true;
     }
     else
@@ -71,6 +164,182 @@ bool ReadWAV::getSamples(vector<int16_t> &samples, int sec_st, int sec_end)
     }
 }
 
+void ReadWAV::setIOMode(IOMode mode)
+{
+    // Takes effect with the next file opened
+    this->mode = mode;
+}
+
+int64_t ReadWAV::tell()
+{
+    return this->active == IOMode::Direct ? (int64_t)this->position : (int64_t)this->file.tellg();
+}
+
+void ReadWAV::seek(u_int64_t offset)
+{
+    if (this->active == IOMode::Direct)
+        this->position = offset;
+    else
+        this->file.seekg(offset, ios::beg);
+}
+
+void ReadWAV::readData(char *data, size_t size)
+{
+    // A hole of a sparse file reads as zeros without touching the disk
+    this->lastBlockHole = this->inHole(this->tell(), size);
+    if (this->lastBlockHole)
+    {
+        memset(data, 0, size);
+        this->seek(this->tell() + size);
+        return;
+    }
+
+    if (this->active == IOMode::Direct)
+    {
+        this->position += this->direct.read(this->position, data, size);
+        return;
+    }
+
+    this->file.read(data, size);
+
+    // The pages behind the read position are dropped every few megabytes
+    if (this->active == IOMode::NoCache)
+    {
+        u_int64_t pos = this->file.tellg();
+        if (pos < this->advised)
+            this->advised = pos;
+        else if (pos - this->advised >= pacingChunk)
+        {
+            posix_fadvise(this->sideFd, this->advised, pos - this->advised, POSIX_FADV_DONTNEED);
+            this->advised = pos;
+        }
+    }
+}
+
+bool ReadWAV::inHole(u_int64_t offset, u_int64_t size)
+{
+    // One SEEK_DATA or SEEK_HOLE lookup per region of the file, reads inside it need none
+    int fd = this->active == IOMode::Direct ? this->direct.getFd() : this->sideFd;
+    if (fd < 0)
+        return false;
+
+    if (offset < this->regionStart || offset >= this->regionEnd)
+    {
+        off_t data = lseek(fd, offset, SEEK_DATA);
+        if (data < 0 && errno != ENXIO)
+            return false;
+
+        // No data after offset means a hole up to the end of the file
+        this->regionStart = offset;
+        this->regionHole = data < 0 || (u_int64_t)data > offset;
+        if (this->regionHole)
+            this->regionEnd = data < 0 ? numeric_limits<u_int64_t>::max() : data;
+        else
+        {
+            off_t hole = lseek(fd, offset, SEEK_HOLE);
+            this->regionEnd = hole < 0 ? numeric_limits<u_int64_t>::max() : hole;
+        }
+    }
+
+    return this->regionHole && offset + size <= this->regionEnd;
+}
+
+bool ReadWAV::blockIsHole()
+{
+    return this->lastBlockHole;
+}
+
+bool ReadWAV::blockIsSilent()
+{
+    return this->lastBlockSilent;
+}
+
+int ReadWAV::getFd()
+{
+    if (this->resampler)
+        return -1;
+    return this->active == IOMode::Direct ? this->direct.getFd() : this->sideFd;
+}
+
+bool ReadWAV::isConverted()
+{
+    return this->resampler != nullptr;
+}
+
+void ReadWAV::setResampleQuality(ResampleQuality quality)
+{
+    this->quality = quality;
+}
+
+ResampleQuality ReadWAV::getResampleQuality()
+{
+    return this->quality;
+}
+
+bool ReadWAV::getConverted(vector<int16_t> &samples, int sec_st, int sec_end)
+{
+    // A second is the same at both rates, so a range of seconds starts on a converted sample
+    const u_int64_t first = min((u_int64_t)pipelineRate * sec_st, this->getSampleCount());
+    if (this->outPos <= first)
+    {
+        this->restart(first);
+        this->remainingDataSize = min((u_int64_t)(sec_end - sec_st) * pipelineRate, this->getSampleCount() - first);
+    }
+
+    if (this->remainingDataSize == 0)
+        return false;
+
+    // The file is read in blocks until the converter has the whole block, then its end is zeros
+    const size_t size = min((u_int64_t)this->getUnitSize(), this->remainingDataSize);
+    samples.resize(size);
+    size_t made = this->resampler->pull(samples.data(), size);
+    while (made < size)
+    {
+        if (this->rawRemaining > 0)
+        {
+            this->raw.resize(min((u_int64_t)this->getUnitSize(), this->rawRemaining));
+            this->readData((char *)this->raw.data(), this->raw.size() * sizeof(int16_t));
+            this->rawRemaining -= this->raw.size();
+            this->resampler->push(this->raw.data(), this->raw.size());
+        }
+        else
+            this->resampler->finish();
+        made += this->resampler->pull(samples.data() + made, size - made);
+    }
+
+    this->outPos += size;
+    this->remainingDataSize -= size;
+    this->lastBlockHole = false;
+    this->lastBlockSilent = isSilent(samples);
+    return true;
+}
+
+void ReadWAV::restart(u_int64_t n)
+{
+    // The converter asks for the input from a little before the time of sample n
+    const u_int64_t fileCount = this->fileHeader.subchunk2Size / sizeof(int16_t);
+    const u_int64_t input = min(this->resampler->start(n), fileCount);
+    this->seek(sizeof(WAVHeader) + input * sizeof(int16_t));
+    this->rawRemaining = fileCount - input;
+    this->outPos = n;
+}
+
+void ReadWAV::setCancelFlag(const atomic<bool> *cancelled)
+{
+    this->cancelled = cancelled;
+}
+
+void ReadWAV::seekSample(u_int64_t first, u_int64_t last)
+{
+    // Later calls of getSamples go on from here as long as they start at or before this point
+    first = min(first, this->getSampleCount());
+    if (this->resampler)
+        this->restart(first);
+    else
+        this->seek(sizeof(WAVHeader) + first * sizeof(int16_t));
+    this->remainingDataSize = min(last, this->getSampleCount()) - first;
+}
+
 uint32_t ReadWAV::getSampleRate()
 {
     // Returns the sample rate of the WAV file
@@ -85,8 +354,14 @@ WAVHeader *ReadWAV::getHeader()
 
 int ReadWAV::getSizeFile()
 {
-    header->subchunk2Size = 31753078;
-    return header->subchunk2Size / (2 * header->sampleRate);
+    // Returns the duration in whole seconds, a trailing partial second counts as one
+    return (this->getSampleCount() + header->sampleRate - 1) / header->sampleRate;
+}
+
+u_int64_t ReadWAV::getSampleCount()
+{
+    // Returns the number of samples in the data chunk
+    return header->subchunk2Size / sizeof(int16_t);
 }
 
 // Implementation of WriteWAV class methods
@@ -94,25 +369,65 @@ bool WriteWAV::openWAVFile(string outputFileName)
 {
     // Opens the output WAV file
     this->outputFileName = outputFileName;
+    this->active = this->mode;
+    this->position = 0;
+    this->pacedFrom = this->pacedTo = 0;
+    this->sparse = true;
+
+    if (this->active == IOMode::Direct)
+    {
+        if (this->direct.open(outputFileName, true))
+            return true;
+        cout << "io: no O_DIRECT for " << outputFileName << ", dropping cached pages instead" << endl;
+        this->active = IOMode::NoCache;
+    }
+
     this->file.open(outputFileName, ios::in | ios::out | ios::binary);
 
     if (!this->file.is_open())
         throw runtime_error("Failed to open the file. Please check the file name or path.\n");
 
+    this->sideFd = open(outputFileName.c_str(), O_WRONLY);
+
     return this->file.is_open();
 }
 
 bool WriteWAV::closeWAVFile()
 {
     // Closes the output WAV file
+    if (this->active == IOMode::Direct)
+    {
+        this->direct.close();
+        return true;
+    }
+
     this->file.close();
+    if (this->sideFd >= 0)
+    {
+        // The rest of the output is written back before its pages can be dropped
+        if (this->active == IOMode::NoCache)
+        {
+            fdatasync(this->sideFd);
+            posix_fadvise(this->sideFd, 0, 0, POSIX_FADV_DONTNEED);
+        }
+        close(this->sideFd);
+        this->sideFd = -1;
+    }
     return !this->file.is_open();
 }
 
 void WriteWAV::writeHead(ReadWAV &reader)
 {
     // Writes the WAV header from the source file to the output file
-    file.write((const char *)(reader.getHeader()), sizeof(WAVHeader));
+    this->writeData((const char *)(reader.getHeader()), sizeof(WAVHeader));
+
+    // The whole output is reserved up front, the file still grows as it is written
+    int fd = open(this->outputFileName.c_str(), O_WRONLY);
+    if (fd >= 0)
+    {
+        fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, sizeof(WAVHeader) + (u_int64_t)reader.getHeader()->subchunk2Size);
+        close(fd);
+    }
 }
 
 void WriteWAV::saveSamples(ReadWAV &reader, vector<int16_t> &samples, int sec_st)
@@ -120,21 +435,249 @@ void WriteWAV::saveSamples(ReadWAV &reader, vector<int16_t> &samples, int sec_st
     // Writes the audio samples to the output file at the specified time offset
     u_int64_t offset = 2 * (u_int64_t)reader.getSampleRate() * (u_int64_t)sec_st + (u_int64_t)sizeof(WAVHeader);
 
-    streampos currentPos = file.tellp();
+    int64_t currentPos = this->tell();
+
+    if (currentPos < (int64_t)offset)
+        this->seek(offset);
+
+    this->writeData((const char *)(samples.data()), samples.size() * sizeof(int16_t));
+}
+
+void WriteWAV::setIOMode(IOMode mode)
+{
+    // Takes effect with the next file opened
+    this->mode = mode;
+}
+
+u_int64_t WriteWAV::memoryUse()
+{
+    return this->direct.memoryUse();
+}
+
+int64_t WriteWAV::tell()
+{
+    return this->active == IOMode::Direct ? (int64_t)this->position : (int64_t)this->file.tellp();
+}
 
-    if (currentPos < offset)
+void WriteWAV::seek(u_int64_t offset)
+{
+    if (this->active == IOMode::Direct)
+        this->position = offset;
+    else
         this->file.seekp(offset, ios::beg);
+}
+
+void WriteWAV::writeData(const char *data, size_t size)
+{
+    // Runs of whole zero blocks become holes, everything else is written
+    static const char zeros[holeBlock] = {};
+    const u_int64_t pos = this->tell();
+    size_t done = 0;
+
+    auto flushRun = [&](size_t from, size_t to)
+    {
+        if (to - from < minHole)
+            return;
+        this->writeBytes(data + done, from - done);
+        if (this->punch(pos + from, to - from))
+        {
+            this->seek(pos + to);
+            done = to;
+        }
+        else
+            done = from;
+    };
+
+    if (this->sparse && size >= minHole)
+    {
+        size_t run = SIZE_MAX;
+        size_t b = (holeBlock - pos % holeBlock) % holeBlock;
+        for (; b + holeBlock <= size && this->sparse; b += holeBlock)
+        {
+            bool zero = memcmp(data + b, zeros, holeBlock) == 0;
+            if (zero && run == SIZE_MAX)
+                run = b;
+            else if (!zero && run != SIZE_MAX)
+            {
+                flushRun(run, b);
+                run = SIZE_MAX;
+            }
+        }
+        if (run != SIZE_MAX && this->sparse)
+            flushRun(run, b);
+    }
+
+    this->writeBytes(data + done, size - done);
+}
+
+void WriteWAV::writeBytes(const char *data, size_t size)
+{
+    if (this->active == IOMode::Direct)
+    {
+        this->direct.write(this->position, data, size);
+        this->position += size;
+        return;
+    }
+
+    this->file.write(data, size);
+    if (this->active == IOMode::NoCache)
+        this->pace();
+}
+
+void WriteWAV::writeZeros(u_int64_t size)
+{
+    // The whole blocks in the middle become a hole, the edges are written as zeros
+    static const vector<char> zeros(minHole, 0);
+    const u_int64_t pos = this->tell();
+    const u_int64_t first = (pos + holeBlock - 1) / holeBlock * holeBlock;
+    const u_int64_t last = (pos + size) / holeBlock * holeBlock;
+
+    if (this->sparse && first < last && last - first >= minHole && this->punch(first, last - first))
+    {
+        this->writeBytes(zeros.data(), first - pos);
+        this->seek(last);
+        this->writeBytes(zeros.data(), pos + size - last);
+        return;
+    }
+
+    for (u_int64_t done = 0; done < size; done += zeros.size())
+        this->writeBytes(zeros.data(), min((u_int64_t)zeros.size(), size - done));
+}
+
+bool WriteWAV::punch(u_int64_t offset, u_int64_t size)
+{
+    // Stops trying for this file once the file system refuses
+    bool punched;
+    if (this->active == IOMode::Direct)
+        punched = this->direct.punch(offset, size);
+    else
+    {
+        // Bytes still in the stream buffer may lie inside the range, and the range has to be
+        // inside the file: the blocks reserved past its end would stay allocated otherwise
+        this->file.flush();
+        struct stat info;
+        if (fstat(this->sideFd, &info) == 0 && (u_int64_t)info.st_size < offset + size &&
+            ftruncate(this->sideFd, offset + size) < 0)
+            throw runtime_error("Failed to write " + this->outputFileName + "!\n");
+        punched = fallocate(this->sideFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0;
+    }
+
+    if (!punched)
+        this->sparse = false;
+    return punched;
+}
+
+void WriteWAV::saveSilence(u_int64_t first, u_int64_t count)
+{
+    this->seek(sizeof(WAVHeader) + first * sizeof(int16_t));
+    this->writeZeros(count * sizeof(int16_t));
+}
+
+u_int64_t WriteWAV::copySamples(ReadWAV &reader, u_int64_t first, u_int64_t count)
+{
+    // The window of a direct file would miss what the kernel writes beside it
+    if (!this->copies || this->active == IOMode::Direct || reader.getFd() < 0)
+        return 0;
+
+    this->file.flush();
+    loff_t from = sizeof(WAVHeader) + first * sizeof(int16_t);
+    loff_t to = this->tell();
+    const loff_t start = to;
+    u_int64_t left = count * sizeof(int16_t);
+    while (left > 0)
+    {
+        // The file system may share the blocks, or else the kernel copies them page by page
+        ssize_t done = copy_file_range(reader.getFd(), &from, this->sideFd, &to, min(left, (u_int64_t)1 << 30), 0);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+        {
+            // Not between these files, what is left is read and written as usual
+            this->copies = done == 0;
+            break;
+        }
+        left -= done;
+    }
+
+    // A sample cut in half is written again with the next block
+    const u_int64_t samples = (to - start) / sizeof(int16_t);
+    this->seek(start + samples * sizeof(int16_t));
+    if (this->active == IOMode::NoCache)
+        this->pace();
+    return samples;
+}
+
+void WriteWAV::pace()
+{
+    // Writeback of every step is started as soon as it is written and waited for one step
+    // later, then its pages are dropped: the cache holds about two steps of the output
+    u_int64_t pos = this->file.tellp();
+    if (pos < this->pacedTo)
+    {
+        this->pacedFrom = this->pacedTo = pos;
+        return;
+    }
+    if (pos - this->pacedTo < pacingChunk)
+        return;
 
-    this->file.write((const char *)(samples.data()), samples.size() * sizeof(int16_t));
+    this->file.flush();
+    sync_file_range(this->sideFd, this->pacedTo, pos - this->pacedTo, SYNC_FILE_RANGE_WRITE);
+    if (this->pacedFrom < this->pacedTo)
+    {
+        sync_file_range(this->sideFd, this->pacedFrom, this->pacedTo - this->pacedFrom,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(this->sideFd, this->pacedFrom, this->pacedTo - this->pacedFrom, POSIX_FADV_DONTNEED);
+    }
+
+    this->pacedFrom = this->pacedTo;
+    this->pacedTo = pos;
+}
+
+void WriteWAV::seekSample(u_int64_t count)
+{
+    this->seek(sizeof(WAVHeader) + count * sizeof(int16_t));
+}
+
+void WriteWAV::sync()
+{
+    if (this->active == IOMode::Direct)
+    {
+        this->direct.flush();
+        if (fdatasync(this->direct.getFd()) < 0)
+            throw runtime_error("Failed to sync " + this->outputFileName + "!\n");
+        return;
+    }
+
+    // Any descriptor of the file flushes the pages written through the stream
+    this->file.flush();
+    int fd = open(this->outputFileName.c_str(), O_RDONLY);
+    if (fd < 0 || fsync(fd) < 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        throw runtime_error("Failed to sync " + this->outputFileName + "!\n");
+    }
+    close(fd);
 }
 
 // ParseCmdLineArg class constructor and methods
 
-ParseCmdLineArg::ParseCmdLineArg(int argv, char **argc)
+ParseCmdLineArg::ParseCmdLineArg(int argv, char **argc) : ParseCmdLineArg(vector<string>(argc, argc + argv))
+{
+}
+
+ParseCmdLineArg::ParseCmdLineArg(vector<string> argList)
 {
     // Parses command line arguments and extracts necessary file names
-    size_t index = 0;
-    this->args.assign(argc, argc + argv);
+
+    // Long options may appear anywhere, the remaining arguments are positional
+    for (size_t i = 0; i < argList.size(); ++i)
+    {
+        if (i > 0 && argList[i].starts_with("--"))
+            this->options.push_back(argList[i]);
+        else
+            this->args.push_back(argList[i]);
+    }
 
     auto it = find(this->args.begin(), this->args.end(), "-h");
 
@@ -142,9 +685,21 @@ ParseCmdLineArg::ParseCmdLineArg(int argv, char **argc)
     {
         this->mode = 0;
     }
+    else if (this->hasOption("--serve") || this->hasOption("--stats") || this->hasOption("--cancel"))
+    {
+        // The daemon gets its files from the jobs, the control requests need none
+        this->mode = 1;
+    }
     else
     {
         it = find(this->args.begin(), this->args.end(), "-c");
+        if (it == this->args.end())
+        {
+            // A graph file instead of a config, the main file comes right after it
+            it = find(this->args.begin(), this->args.end(), "-g");
+            this->graph = it != this->args.end();
+            this->mainIndex = this->graph ? 3 : 4;
+        }
 
         if ((it != this->args.end()) && (++it != this->args.end()))
         {
@@ -174,6 +729,57 @@ bool ParseCmdLineArg::getMode()
     return mode;
 }
 
+bool ParseCmdLineArg::isGraph()
+{
+    return this->graph;
+}
+
+bool ParseCmdLineArg::hasOption(string name)
+{
+    // Checks whether the flag was given, with or without a value
+    for (const string &opt : this->options)
+        if (opt == name || opt.starts_with(name + "="))
+            return true;
+
+    return false;
+}
+
+vector<string> ParseCmdLineArg::getOptions()
+{
+    return this->options;
+}
+
+int ParseCmdLineArg::getInWAVFileCount()
+{
+    // Returns the number of auxiliary WAV files after the main one
+    return max((int)this->args.size() - (int)this->mainIndex - 1, 0);
+}
+
+string ParseCmdLineArg::getOption(string name, string defaultValue)
+{
+    // Returns the value of a "--name=value" option
+    for (const string &opt : this->options)
+        if (opt.starts_with(name + "="))
+            return opt.substr(name.length() + 1);
+
+    return defaultValue;
+}
+
+u_int64_t ParseCmdLineArg::getNumberOption(string name, u_int64_t defaultValue, u_int64_t low, u_int64_t high)
+{
+    // Only plain decimal digits are taken, "10MB", "-1" or "1e3" are refused
+    const string value = this->getOption(name, "");
+    if (value.empty())
+        return defaultValue;
+    if (value.find_first_not_of("0123456789") != string::npos || value.size() > 19)
+        throw invalid_argument("Invalid parameters!\n");
+
+    const u_int64_t number = stoull(value);
+    if (number < low || number > high)
+        throw invalid_argument("Invalid parameters!\n");
+    return number;
+}
+
 string ParseCmdLineArg::getConfFileName()
 {
     // Returns the configuration file name
@@ -183,19 +789,21 @@ string ParseCmdLineArg::getConfFileName()
 string ParseCmdLineArg::getMainWAVFileName()
 {
     // Returns the main WAV file name from command line arguments
-    return this->args.at(4);
+    return this->args.at(this->mainIndex);
 }
 
 // Rest of the code follows similar patterns with appropriate comments.
 
 string ParseCmdLineArg::getInWAVFileName(int n)
 {
-    return this->args.at(4 + n);
+    return this->args.at(this->mainIndex + n);
 }
 
 string ParseCmdLineArg::getOutWAVFileName()
 {
     // Retrieves the name of the output WAV file from the command line arguments
+    if (this->graph)
+        throw logic_error("A graph names its outputs in the graph file!\n");
     return this->args.at(3);
 }
 
@@ -214,24 +822,54 @@ void Mute::convert(string inFileName, string OutFileName, ReadWAV &reader, Write
     // Copies the input WAV file to the output path
     fs::copy(inFileName, OutFileName, fs::copy_options::overwrite_existing);
 
-    // Opens the output file for writing
+    // Reads the header of the input to know its rate and length
+    reader.openWAVFile(inFileName);
+    reader.parseHead();
+    reader.checkCorrect();
+    reader.closeWAVFile();
+
+    // The muted samples, up to the end of the data, become a hole where the file system allows
+    const u_int64_t count = reader.getSampleCount();
+    const u_int64_t first = min((u_int64_t)this->left * reader.getSampleRate(), count);
+    const u_int64_t last = min((u_int64_t)this->right * reader.getSampleRate(), count);
+
     writer.openWAVFile(OutFileName);
+    writer.saveSilence(first, last - first);
+    writer.closeWAVFile();
+}
+
+string Mute::describe()
+{
+    return "mute " + to_string(this->left) + " " + to_string(this->right);
+}
 
-    // Calculate the number of seconds to mute
-    int countSec = this->right - this->left;
+pair<u_int64_t, u_int64_t> Mute::affectedRange(u_int32_t sampleRate)
+{
+    return {(u_int64_t)this->left * sampleRate, (u_int64_t)this->right * sampleRate};
+}
 
-    // Create a vector of silent samples (all zeroes)
-    vector<int16_t> samples(reader.getUnitSize(), 0);
+Converter *Mute::window(u_int32_t from, u_int32_t to)
+{
+    u_int32_t left = max(this->left, from);
+    u_int32_t right = min(this->right, to);
+    if (left >= right)
+        return nullptr;
 
-    // Write silent samples for the specified duration
-    while (countSec)
-    {
-        writer.saveSamples(reader, samples, left);
-        --countSec;
-    }
+    return new Mute(left - from, right - from);
+}
 
-    // Close the output WAV file
-    writer.closeWAVFile();
+void Mute::prepare(u_int32_t sampleRate)
+{
+    this->sampleRate = sampleRate;
+}
+
+void Mute::processBlock(vector<int16_t> &samples, u_int64_t pos)
+{
+    // Zeroes the part of the block inside [left, right)
+    u_int64_t begin = max(pos, (u_int64_t)this->left * this->sampleRate);
+    u_int64_t end = min(pos + samples.size(), (u_int64_t)this->right * this->sampleRate);
+    if (begin < end)
+        fill(samples.begin() + (begin - pos), samples.begin() + (end - pos), 0);
 }
 
 void Mute::help()
@@ -243,10 +881,11 @@ void Mute::help()
 }
 
 // Constructor for the Mix class, initializes the source file and starting offset
-Mix::Mix(string nameSrcFile, u_int32_t start_with)
+Mix::Mix(string nameSrcFile, u_int32_t start_with, u_int32_t skip)
 {
     this->nameSrcFile = nameSrcFile;
     this->start_with = start_with;
+    this->skip = skip;
 }
 
 // Averages samples from two vectors: modifies `samples` in-place
@@ -276,16 +915,21 @@ void Mix::convert(string inFileName, string OutFileName, ReadWAV &reader, WriteW
     reader.parseHead();
     reader.checkCorrect();
 
+    // The source comes from memory if the job preloaded it, otherwise from its file
     ReadWAV src_reader;
-    src_reader.openWAVFile(this->nameSrcFile);
-    src_reader.parseHead();
-    src_reader.checkCorrect();
+    src_reader.setResampleQuality(this->quality);
+    if (!this->srcData)
+    {
+        src_reader.openWAVFile(this->nameSrcFile);
+        src_reader.parseHead();
+        src_reader.checkCorrect();
+    }
 
     // Open the output WAV file for writing
     writer.openWAVFile(OutFileName);
 
     // Get file durations
-    const int src_size = src_reader.getSizeFile();
+    const int src_size = (this->sourceLength() + reader.getSampleRate() - 1) / reader.getSampleRate();
     const int size = reader.getSizeFile();
 
     cout << src_size << ' ' << size << endl;
@@ -296,11 +940,24 @@ void Mix::convert(string inFileName, string OutFileName, ReadWAV &reader, WriteW
     vector<int16_t> samples;
     samples.reserve(reader.getSampleRate());
 
-    // Mix samples from source and input files
-    bool flag = true;
-    while (src_reader.getSamples(src_samples, 0, src_size) && flag)
+    u_int64_t src_pos = (u_int64_t)this->skip * reader.getSampleRate();
+    auto nextSource = [&]() -> bool
+    {
+        if (!this->srcData)
+            return src_reader.getSamples(src_samples, this->skip, src_size);
+
+        if (src_pos >= this->srcData->size())
+            return false;
+
+        size_t count = min((u_int64_t)reader.getUnitSize(), this->srcData->size() - src_pos);
+        src_samples.assign(this->srcData->begin() + src_pos, this->srcData->begin() + src_pos + count);
+        src_pos += count;
+        return true;
+    };
+
+    // Mix samples from source and input files until one of them ends
+    while (nextSource() && reader.getSamples(samples, this->start_with, size))
     {
-        flag = reader.getSamples(samples, this->start_with, size);
         this->avg_samples(samples, src_samples);
         writer.saveSamples(reader, samples, this->start_with);
         cout << 1;
@@ -313,6 +970,156 @@ void Mix::convert(string inFileName, string OutFileName, ReadWAV &reader, WriteW
     writer.closeWAVFile();
 }
 
+string Mix::describe()
+{
+    // The source file enters the cache key through auxFiles()
+    return "mix " + to_string(this->start_with);
+}
+
+vector<string> Mix::auxFiles()
+{
+    return {this->nameSrcFile};
+}
+
+u_int64_t Mix::sourceLength()
+{
+    // Returns the number of samples in the source
+    if (this->srcData)
+        return this->srcData->size();
+
+    ReadWAV src_reader;
+    src_reader.setResampleQuality(this->quality);
+    src_reader.openWAVFile(this->nameSrcFile);
+    src_reader.parseHead();
+    src_reader.checkCorrect();
+    src_reader.closeWAVFile();
+    return src_reader.getSampleCount();
+}
+
+pair<u_int64_t, u_int64_t> Mix::affectedRange(u_int32_t sampleRate)
+{
+    // The mix covers the rest of the source, starting at start_with
+    u_int64_t length = this->sourceLength();
+    u_int64_t skipped = min((u_int64_t)this->skip * sampleRate, length);
+    u_int64_t begin = (u_int64_t)this->start_with * sampleRate;
+    return {begin, begin + length - skipped};
+}
+
+Converter *Mix::window(u_int32_t from, u_int32_t to)
+{
+    // A window past the end of the source gets a mix that runs out of source at once
+    if (this->start_with >= to)
+        return nullptr;
+
+    // A window starting inside the mix skips the part of the source before it
+    Mix *mix;
+    if (this->start_with >= from)
+        mix = new Mix(this->nameSrcFile, this->start_with - from, this->skip);
+    else
+        mix = new Mix(this->nameSrcFile, 0, this->skip + from - this->start_with);
+
+    mix->srcData = this->srcData;
+    mix->quality = this->quality;
+    return mix;
+}
+
+void Mix::useAuxData(const string &name, shared_ptr<const vector<int16_t>> data)
+{
+    if (name == this->nameSrcFile)
+        this->srcData = data;
+}
+
+void Mix::useResampleQuality(ResampleQuality quality)
+{
+    this->quality = quality;
+}
+
+void Mix::prepare(u_int32_t sampleRate)
+{
+    // Opens the source for reading along with the stream
+    this->sampleRate = sampleRate;
+    this->srcLength = this->sourceLength();
+    this->pendingStart = min((u_int64_t)this->skip * sampleRate, this->srcLength);
+    this->srcPending.clear();
+
+    if (!this->srcData)
+    {
+        this->srcReader = make_unique<ReadWAV>();
+        this->srcReader->setResampleQuality(this->quality);
+        this->srcReader->openWAVFile(this->nameSrcFile);
+        this->srcReader->parseHead();
+        this->srcReader->checkCorrect();
+    }
+}
+
+void Mix::processBlock(vector<int16_t> &samples, u_int64_t pos)
+{
+    // Stream position p is mixed with source sample p - mixStart + skipped
+    const u_int64_t skipped = min((u_int64_t)this->skip * this->sampleRate, this->srcLength);
+    const u_int64_t mixStart = (u_int64_t)this->start_with * this->sampleRate;
+    const u_int64_t begin = max(pos, mixStart);
+    const u_int64_t end = min(pos + samples.size(), mixStart + this->srcLength - skipped);
+    if (begin >= end)
+        return;
+
+    const u_int64_t srcBegin = begin - mixStart + skipped;
+    const u_int64_t srcEnd = end - mixStart + skipped;
+    const int16_t *src;
+
+    if (this->srcData)
+        src = this->srcData->data() + srcBegin;
+    else
+    {
+        // Blocks come in order, so the samples before this block are not needed any more
+        u_int64_t drop = min(srcBegin - this->pendingStart, (u_int64_t)this->srcPending.size());
+        this->srcPending.erase(this->srcPending.begin(), this->srcPending.begin() + drop);
+        this->pendingStart += drop;
+
+        vector<int16_t> unit;
+        while (this->pendingStart + this->srcPending.size() < srcEnd &&
+               this->srcReader->getSamples(unit, this->skip, this->srcReader->getSizeFile()))
+            this->srcPending.insert(this->srcPending.end(), unit.begin(), unit.end());
+
+        src = this->srcPending.data() + (srcBegin - this->pendingStart);
+    }
+
+    int16_t *dst = samples.data() + (begin - pos);
+    for (u_int64_t i = 0; i < end - begin; ++i)
+        dst[i] = (dst[i] + src[i]) / 2;
+}
+
+bool Mix::processSilence(u_int64_t pos, size_t count)
+{
+    // Inside the mixed range the source comes through, outside it the silence stays
+    const u_int64_t skipped = min((u_int64_t)this->skip * this->sampleRate, this->srcLength);
+    const u_int64_t mixStart = (u_int64_t)this->start_with * this->sampleRate;
+    return max(pos, mixStart) >= min(pos + count, mixStart + this->srcLength - skipped);
+}
+
+void Mix::saveState(ostream &out)
+{
+    // The samples read ahead from the source, its reader goes on after them
+    writeRaw(out, this->pendingStart);
+    writeRaw(out, this->srcPending);
+}
+
+void Mix::loadState(istream &in)
+{
+    readRaw(in, this->pendingStart);
+    readRaw(in, this->srcPending);
+    if (this->srcReader)
+        this->srcReader->seekSample(this->pendingStart + this->srcPending.size(), this->srcLength);
+}
+
+u_int64_t Mix::memoryUse(u_int32_t sampleRate, size_t count)
+{
+    // A source in memory is counted where it is kept. One read from its file holds the second
+    // just read and what is read ahead, up to a second more than a block.
+    if (this->srcData)
+        return 0;
+    return (2 * (u_int64_t)sampleRate + count) * sizeof(int16_t);
+}
+
 void Mix::help()
 {
     cout << "\033[33m   Mix converter\033[0m" << endl
@@ -339,6 +1146,13 @@ Converter *MixCreater::creatConverter(u_int32_t start, string nameSrcFile)
     return mix;
 }
 
+// Factory method for creating Filter converters
+Converter *FilterCreater::creatConverter(string kind, double freq, double gain, double q, int order)
+{
+    Filter *filter = new Filter(kind, freq, gain, q, order);
+    return filter;
+}
+
 // Constructor for parsing configuration file paths
 ParseConfigFile::ParseConfigFile(string name)
 {
@@ -349,6 +1163,12 @@ ParseConfigFile::ParseConfigFile(string name)
 queue<Converter *> ParseConfigFile::parsing(ParseCmdLineArg &parseArgs)
 {
     ifstream fin(this->confFileName);
+    return this->parsing(fin, parseArgs);
+}
+
+// Parses commands from a stream, the daemon passes the config text of a job this way
+queue<Converter *> ParseConfigFile::parsing(istream &fin, ParseCmdLineArg &parseArgs)
+{
     queue<Converter *> conv_queue;
     string str;
     string tmp;
@@ -358,6 +1178,9 @@ queue<Converter *> ParseConfigFile::parsing(ParseCmdLineArg &parseArgs)
     MuteCreater muteCreater;
     MixCreater mixCreater;
     ReverberationCreater revbCreater;
+    FilterCreater filterCreater;
+    LimiterCreater limiterCreater;
+    DenoiseCreater denoiseCreater;
 
     // Read and parse each command in the config file
     while (fin >> str)
@@ -401,6 +1224,59 @@ queue<Converter *> ParseConfigFile::parsing(ParseCmdLineArg &parseArgs)
             Reverberation *revb = (Reverberation *)revbCreater.creatConverter(left, rigth, k);
             conv_queue.push(revb);
         }
+        else if (str == "highpass" || str == "lowpass")
+        {
+            // Add a Butterworth filter of the given order to the queue
+            double freq = 0.0;
+            int order = 0;
+            fin >> freq >> order;
+
+            if ((freq <= 0.0) || (order < 1) || (order > 16))
+            {
+                throw invalid_argument("Invalid parameters!\n");
+            }
+
+            conv_queue.push(filterCreater.creatConverter(str, freq, 0.0, 0.0, order));
+        }
+        else if (str == "peaking" || str == "lowshelf" || str == "highshelf")
+        {
+            // Add an equalizer band to the queue
+            double freq = 0.0, gain = 0.0, q = 0.0;
+            fin >> freq >> gain >> q;
+
+            if ((freq <= 0.0) || (q <= 0.0))
+            {
+                throw invalid_argument("Invalid parameters!\n");
+            }
+
+            conv_queue.push(filterCreater.creatConverter(str, freq, gain, q, 2));
+        }
+        else if (str == "limiter")
+        {
+            // Add a lookahead limiter to the queue
+            double ceiling = 0.0, lookahead = 0.0, attack = 0.0, release = 0.0;
+            fin >> ceiling >> lookahead >> attack >> release;
+
+            if ((ceiling > 0.0) || (lookahead <= 0.0) || (lookahead > 1000.0) || (attack <= 0.0) || (release <= 0.0))
+            {
+                throw invalid_argument("Invalid parameters!\n");
+            }
+
+            conv_queue.push(limiterCreater.creatConverter(ceiling, lookahead, attack, release));
+        }
+        else if (str == "denoise")
+        {
+            // Add a spectral noise gate to the queue
+            double reduction = 0.0;
+            fin >> left >> rigth >> reduction;
+
+            if ((left >= rigth) || (reduction < 0.0))
+            {
+                throw invalid_argument("Invalid parameters!\n");
+            }
+
+            conv_queue.push(denoiseCreater.creatConverter(left, rigth, reduction));
+        }
         else
         {
             // Handle unknown commands
@@ -413,40 +1289,258 @@ queue<Converter *> ParseConfigFile::parsing(ParseCmdLineArg &parseArgs)
 
 void Main::soundProcessing(int argc, char **argv)
 {
-
-    ReadWAV reader;
-    WriteWAV writer;
     ParseCmdLineArg parserCmdLine(argc, argv);
 
     string confFileName = parserCmdLine.getConfFileName();
 
     ParseConfigFile parserConfFile(confFileName);
-    queue<Converter *> convs = parserConfFile.parsing(parserCmdLine);
+    Job job(parserCmdLine, parserConfFile.parsing(parserCmdLine));
+    job.run();
+}
+
+// --io=direct or --io=nocache keep the samples of the passes out of the page cache
+static IOMode ioModeOption(ParseCmdLineArg &args)
+{
+    const string io = args.getOption("--io", "buffered");
+    if (io != "buffered" && io != "direct" && io != "nocache")
+        throw invalid_argument("Unknown I/O mode " + io + "!\n");
+    return io == "direct" ? IOMode::Direct : io == "nocache" ? IOMode::NoCache : IOMode::Buffered;
+}
+
+// --resample=fast|medium|best picks the converter for files that are not at the pipeline rate
+static ResampleQuality resampleOption(ParseCmdLineArg &args)
+{
+    const string quality = args.getOption("--resample", "medium");
+    if (quality != "fast" && quality != "medium" && quality != "best")
+        throw invalid_argument("Unknown resampling quality " + quality + "!\n");
+    return quality == "fast" ? ResampleQuality::Fast : quality == "best" ? ResampleQuality::Best : ResampleQuality::Medium;
+}
+
+// Constructor for Job, the job takes ownership of the converters
+Job::Job(ParseCmdLineArg &args, queue<Converter *> convs, const atomic<bool> *cancelled, AuxCache *auxCache)
+    : args(args), convs(convs)
+{
+    this->cancelled = cancelled;
+    this->auxCache = auxCache;
+}
 
-    reader.openWAVFile(parserCmdLine.getMainWAVFileName());
+Job::~Job()
+{
+    // Removes temporary files even if the job failed halfway, unless a checkpoint lets it resume
+    error_code ec;
+    bool resumable = this->checkpoint && this->checkpoint->hasState() && !this->finished &&
+                     !(this->cancelled && this->cancelled->load());
+    if (!this->workDir.empty() && !resumable)
+        fs::remove_all(this->workDir, ec);
+    if (this->lockFd >= 0)
+        close(this->lockFd);
+
+    while (!this->convs.empty())
+    {
+        delete this->convs.front();
+        this->convs.pop();
+    }
+}
+
+void Job::checkCancelled()
+{
+    if (this->cancelled && this->cancelled->load())
+        throw runtime_error("The job was cancelled!\n");
+}
+
+void Job::run()
+{
+    ReadWAV reader;
+    WriteWAV writer;
+    reader.setCancelFlag(this->cancelled);
+
+    // --resample picks the preset files at another rate are converted with, for this job only
+    const IOMode mode = ioModeOption(this->args);
+    const ResampleQuality quality = resampleOption(this->args);
+    reader.setIOMode(mode);
+    reader.setResampleQuality(quality);
+    writer.setIOMode(mode);
+
+    reader.openWAVFile(this->args.getMainWAVFileName());
     reader.parseHead();
     reader.checkCorrect();
+    const bool converted = reader.isConverted();
     reader.closeWAVFile();
 
-    const string mainFileName = parserCmdLine.getMainWAVFileName();
-    const string outFileName = parserCmdLine.getOutWAVFileName();
+    const string mainFileName = this->args.getMainWAVFileName();
+    const string outFileName = this->args.getOutWAVFileName();
+
+    // Temporary files go next to the output, so that the result can be renamed into place.
+    // A checkpointed job keeps them in "<output>.resume", where a later run finds them.
+    static atomic<u_int64_t> jobCounter{0};
+    this->checkpointing = this->args.hasOption("--checkpoint") || this->args.hasOption("--resume");
+    if (this->checkpointing)
+    {
+        const fs::path resumeDir = fs::absolute(outFileName).string() + ".resume";
+        fs::create_directories(resumeDir);
+        this->lockFd = open(resumeDir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (this->lockFd < 0 || flock(this->lockFd, LOCK_EX | LOCK_NB) < 0)
+            throw runtime_error("Another job is checkpointing " + outFileName + "!\n");
+        this->workDir = resumeDir;
+    }
+    else
+        this->workDir = fs::absolute(outFileName).parent_path() /
+                        (".sound_pr." + to_string(getpid()) + "." + to_string(jobCounter++));
 
-    fs::copy(mainFileName, "./tmp1.wav", fs::copy_options::overwrite_existing);
-    pair<string, string> names{"./tmp1.wav", "./tmp2.wav"};
+    StageCache cache(this->args.getOption("--cache-dir", "./.sound_pr_cache"),
+                     this->args.getNumberOption("--cache-size", 1024, 1, UINT64_MAX >> 20) << 20,
+                     !this->args.hasOption("--no-cache"));
 
-    if (fs::exists(outFileName))
-        fs::remove(outFileName);
+    vector<Converter *> stages;
+    queue<Converter *> owned = this->convs;
+    while (!owned.empty())
+    {
+        stages.push_back(owned.front());
+        owned.pop();
+    }
 
-    while (!convs.empty())
+    for (Converter *conv : stages)
     {
-        Converter *conv = convs.front();
-        convs.pop();
-        conv->convert(names.first, names.second, reader, writer);
-        swap(names.first, names.second);
+        conv->useResampleQuality(quality);
+        if (this->auxCache)
+            for (const string &aux : conv->auxFiles())
+                conv->useAuxData(aux, this->auxCache->get(aux, quality));
+    }
+
+    // keys[k] identifies the output of the first k converters
+    vector<string> keys{cache.rootKey(mainFileName, quality)};
+    for (Converter *conv : stages)
+        keys.push_back(cache.nextKey(keys.back(), conv));
+
+    const bool fuse = !this->args.hasOption("--no-fuse");
+
+    // --pipeline runs every converter of a pass on a thread of its own, --pipeline=N on at most N
+    if (this->args.hasOption("--pipeline"))
+    {
+        this->pipeline.threads = this->args.getNumberOption("--pipeline", stages.size(), 1, UINT32_MAX);
+        this->pipeline.depth = this->args.getNumberOption("--pipeline-depth", 4, 1, UINT32_MAX);
+        this->pipeline.pin = this->args.hasOption("--pin-cores");
+    }
+
+    // The job starts once what its largest pass needs with the smallest blocks is free
+    const size_t smallest = StreamPass::smallestBlock(reader.getSampleRate());
+    u_int64_t need = 0;
+    for (auto group : StreamPass::plan(stages, 0, fuse))
+        need = max(need, StreamPass::memoryNeed(stages, group, reader.getSampleRate(), smallest, this->pipeline));
+    need += reader.memoryUse(smallest) + (mode == IOMode::Direct ? 2 * DirectFile::capacity : 0);
+    if (!this->memory.admit(need, this->cancelled))
+        this->checkCancelled();
+    pair<string, string> names{this->workDir / "tmp1.wav", this->workDir / "tmp2.wav"};
+
+    IncrementalRender incremental(outFileName, this->workDir, fuse);
+    size_t done = 0;
+    bool resuming = false;
+
+    if (this->checkpointing)
+    {
+        this->checkpoint = make_unique<Checkpoint>(this->workDir, keys.back(),
+                                                   this->args.getNumberOption("--checkpoint", 30, 1, UINT32_MAX));
+        Checkpoint *checkpoint = this->checkpoint.get();
+
+        // Goes on from the last checkpoint of the same input, config and grouping
+        resuming = this->args.hasOption("--resume") && checkpoint->load() &&
+                   StreamPass::plan(stages, checkpoint->state.group.first, fuse).front() == checkpoint->state.group;
+
+        if (resuming)
+        {
+            const CheckpointState &state = checkpoint->state;
+            cout << "resume: stages " << state.group.first << " to " << state.group.second << " of "
+                 << stages.size() << endl;
+
+            // At a group boundary the group just starts over
+            if (state.positions.empty())
+                checkpoint->resumed();
+
+            names = {state.inputName, state.outputName};
+            done = state.group.first;
+        }
+        else
+        {
+            if (this->args.hasOption("--resume"))
+                cout << "resume: no checkpoint of this job, starting over" << endl;
+            checkpoint->clear();
+        }
+    }
+
+    if (!resuming)
+    {
+        fs::create_directories(this->workDir);
+
+        // Update the previous output in place if only some of its seconds are affected by the changes
+        if (!this->args.hasOption("--no-incremental") &&
+            incremental.update(mainFileName, stages, reader, writer))
+        {
+            incremental.save(mainFileName, stages, reader.getSampleRate());
+            cout << "memory: " << MemoryBudget::global().report() << endl;
+            this->finished = true;
+            return;
+        }
+
+        // Start from the longest config prefix that is already cached
+        done = stages.size();
+        while (done > 0 && !cache.lookup(keys[done], names.first))
+            --done;
+
+        // The first pass reads the input itself, the passes never write to their input file
+        if (done > 0)
+            cout << "cache: reusing the output of " << done << " of " << stages.size() << " stages" << endl;
+        else
+            names.first = fs::absolute(mainFileName);
+    }
+
+    this->runGroups(stages, done, fuse, names, keys, cache, this->checkpoint.get(), reader, writer);
+
+    this->checkCancelled();
+    if (names.first == fs::absolute(mainFileName) && converted)
+    {
+        // Without commands a file at another rate still comes out at the pipeline rate
+        reader.openWAVFile(mainFileName);
+        reader.parseHead();
+        ofstream(outFileName, ios::binary | ios::trunc).close();
+        writer.openWAVFile(outFileName);
+        writer.writeHead(reader);
+
+        vector<int16_t> samples;
+        while (reader.getSamples(samples, 0, reader.getSizeFile()))
+            writer.saveSamples(reader, samples, 0);
+        reader.closeWAVFile();
+        writer.closeWAVFile();
     }
+    else if (names.first == fs::absolute(mainFileName))
+        fs::copy(mainFileName, outFileName, fs::copy_options::overwrite_existing);
+    else
+        fs::rename(names.first, outFileName);
 
-    fs::remove(names.second);
-    rename(names.first.c_str(), outFileName.c_str());
+    incremental.save(mainFileName, stages, reader.getSampleRate());
+    cout << "memory: " << MemoryBudget::global().report() << endl;
+    this->finished = true;
+}
+
+void Job::runGroups(vector<Converter *> &stages, size_t first, bool fuse, pair<string, string> &names,
+                    vector<string> &keys, StageCache &cache, Checkpoint *checkpoint, ReadWAV &reader, WriteWAV &writer)
+{
+    // Consecutive streamable converters share one pass over the file
+    for (auto group : StreamPass::plan(stages, first, fuse))
+    {
+        this->checkCancelled();
+        if (checkpoint && !checkpoint->isResuming())
+            checkpoint->startGroup(group, names.first, names.second);
+
+        StreamPass::runGroup(stages, group, names.first, names.second, reader, writer, checkpoint, this->pipeline,
+                             &this->memory);
+        // Only the output of the whole group exists, so a later change inside a fused run
+        // reuses the output of the group before it. --no-fuse stores every stage.
+        cache.store(keys[group.second], names.second);
+
+        // The output becomes the input of the next group, which writes the other file
+        const string tmp1 = this->workDir / "tmp1.wav";
+        names = {names.second, names.second == tmp1 ? string(this->workDir / "tmp2.wav") : tmp1};
+    }
 }
 
 void Main::helpPrint()
@@ -454,6 +1548,9 @@ void Main::helpPrint()
     MuteCreater muteCreater;
     MixCreater mixCreater;
     ReverberationCreater revbCreater;
+    FilterCreater filterCreater;
+    LimiterCreater limiterCreater;
+    DenoiseCreater denoiseCreater;
     queue<Converter *> convs;
 
     Mute *mute = (Mute *)muteCreater.creatConverter(0, 1);
@@ -462,6 +1559,9 @@ void Main::helpPrint()
     convs.push(mix);
     Reverberation *revb = (Reverberation *)revbCreater.creatConverter(0, 1, 0.5);
     convs.push(revb);
+    convs.push(filterCreater.creatConverter("highpass", 80.0, 0.0, 0.0, 2));
+    convs.push(limiterCreater.creatConverter(-1.0, 5.0, 2.0, 100.0));
+    convs.push(denoiseCreater.creatConverter(0, 2, 18.0));
 
     while (!convs.empty())
     {
@@ -474,8 +1574,27 @@ void Main::helpPrint()
 void Main::processing(int argc, char **argv)
 {
     ParseCmdLineArg parserCmdLine(argc, argv);
-
+    // --mem-limit in MB bounds the memory of every job of the process together
     if (parserCmdLine.getMode())
+        MemoryBudget::global().setLimit(parserCmdLine.getNumberOption("--mem-limit", 0, 0, UINT64_MAX >> 20) << 20);
+
+    if (parserCmdLine.getMode() && parserCmdLine.hasOption("--serve"))
+    {
+        size_t workers = max(1u, thread::hardware_concurrency());
+        Server server(parserCmdLine.getOption("--serve", "./sound_pr.sock"),
+                      parserCmdLine.getNumberOption("--workers", workers, 1, 4096),
+                      parserCmdLine.getNumberOption("--aux-cache-size", 256, 0, UINT64_MAX >> 20) << 20);
+        server.serve();
+    }
+    else if (parserCmdLine.getMode() && parserCmdLine.hasOption("--submit"))
+    {
+        this->submitJob(parserCmdLine);
+    }
+    else if (parserCmdLine.getMode() && parserCmdLine.isGraph())
+    {
+        this->renderGraph(parserCmdLine);
+    }
+    else if (parserCmdLine.getMode())
     {
         this->soundProcessing(argc, argv);
     }
@@ -483,4 +1602,62 @@ void Main::processing(int argc, char **argv)
     {
         this->helpPrint();
     }
-}
\ No newline at end of file
+}
+
+void Main::renderGraph(ParseCmdLineArg &parserCmdLine)
+{
+    // All outputs of the graph are written in one pass over the main file
+    ifstream fin(parserCmdLine.getConfFileName());
+    if (!fin.is_open())
+        throw runtime_error("The graph file was not found!\n");
+
+    const IOMode mode = ioModeOption(parserCmdLine);
+
+    EffectGraph graph;
+    graph.parse(fin, parserCmdLine);
+
+    ReadWAV reader;
+    reader.setIOMode(mode);
+    reader.setResampleQuality(resampleOption(parserCmdLine));
+    graph.run(parserCmdLine.getMainWAVFileName(), reader, mode);
+}
+
+void Main::submitJob(ParseCmdLineArg &parserCmdLine)
+{
+    // Sends the job, or a control request, to a running daemon and prints its replies
+    string socketName = parserCmdLine.getOption("--submit", "./sound_pr.sock");
+    string request;
+
+    if (parserCmdLine.hasOption("--stats"))
+        request = "STATS\n";
+    else if (parserCmdLine.hasOption("--cancel"))
+        request = "CANCEL " + parserCmdLine.getOption("--cancel", "0") + "\n";
+    else
+    {
+        ifstream fin(parserCmdLine.getConfFileName());
+        if (!fin.is_open())
+            throw runtime_error("The configuration file was not found!\n");
+
+        // The daemon may run in another directory, so paths are sent as absolute ones
+        request = "JOB\n";
+        request += "out " + fs::absolute(parserCmdLine.getOutWAVFileName()).string() + "\n";
+        request += "in " + fs::absolute(parserCmdLine.getMainWAVFileName()).string() + "\n";
+        for (int i = 1; i <= parserCmdLine.getInWAVFileCount(); ++i)
+            request += "aux " + fs::absolute(parserCmdLine.getInWAVFileName(i)).string() + "\n";
+        for (const string &opt : parserCmdLine.getOptions())
+            if (!opt.starts_with("--submit") && !opt.starts_with("--cache-dir"))
+                request += "opt " + opt + "\n";
+
+        // The stage cache of the job is where a run in the client's directory would keep it
+        request += "opt --cache-dir=" +
+                   fs::absolute(parserCmdLine.getOption("--cache-dir", "./.sound_pr_cache")).string() + "\n";
+
+        request += "config\n" + string(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    }
+
+    string reply = Server::request(socketName, request);
+    cout << reply;
+
+    if (reply.find("FAILED") != string::npos || reply.find("CANCELLED") != string::npos)
+        throw runtime_error("The job did not finish!\n");
+}
@@ -8,6 +8,25 @@
 #include <utility>
 #include <filesystem>
 #include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <list>
+#include <map>
+#include <chrono>
+#include <unistd.h>
+#include <array>
+#include <cmath>
+#include <limits>
+#include <complex>
+#include <functional>
+#include <bit>
+#include <exception>
 
 using namespace std;
 namespace fs = std::filesystem;
@@ -30,6 +49,108 @@ struct WAVHeader
     uint32_t subchunk2Size; // Size of the audio data in bytes
 };
 
+// How ReadWAV and WriteWAV move the samples of the data chunk
+enum class IOMode
+{
+    // through the stream buffers and the page cache
+    Buffered,
+    // with O_DIRECT through an aligned buffer, past the page cache
+    Direct,
+    // through the page cache, but pages are dropped once read or written back
+    NoCache
+};
+
+// True if every sample of the block is zero, checked in vectorizable chunks
+bool isSilent(const vector<int16_t> &);
+
+// Rate of every stream inside the program, files at another rate are converted as they are read
+constexpr u_int32_t pipelineRate = 44100;
+
+// Filter length and steepness of the sample rate converter
+enum class ResampleQuality
+{
+    // 16 zero crossings a side, about 60 dB down, passband to 0.73 of Nyquist
+    Fast,
+    // 32 zero crossings a side, about 85 dB down, passband to 0.82 of Nyquist
+    Medium,
+    // 64 zero crossings a side, down to the noise of 16 bits, passband to 0.89 of Nyquist
+    Best
+};
+
+// Streaming polyphase windowed-sinc converter between two rates. With L = to / gcd and
+// M = from / gcd output sample n lies at input time n * M / L, and is the dot product of
+// taps input samples around it with row (n * M) mod L of the filter bank. Ratios with
+// more than maxPhases rows get the nearest of maxPhases evenly spaced ones.
+class Resampler
+{
+private:
+    static constexpr u_int64_t maxPhases = 4096;
+    u_int64_t up;
+    u_int64_t down;
+    u_int64_t phases;
+    size_t taps;
+    // a row of taps coefficients for every phase
+    vector<float> bank;
+    // input samples from historyStart on, the ones before the input are zeros
+    vector<float> history;
+    int64_t historyStart = 0;
+    u_int64_t next = 0;
+    bool ended = false;
+
+public:
+    Resampler(u_int32_t, u_int32_t, ResampleQuality);
+    ~Resampler() = default;
+    // samples the output of count input samples has
+    u_int64_t outputLength(u_int64_t);
+    // the next output sample is n, returns the input sample push() has to go on from
+    u_int64_t start(u_int64_t);
+    void push(const int16_t *, size_t);
+    // the input has ended, zeros follow it
+    void finish();
+    // writes up to count output samples that the input so far allows, returns how many
+    size_t pull(int16_t *, size_t);
+    // bytes of the filter bank and of the history for input pushed count samples at a time
+    u_int64_t memoryUse(size_t);
+};
+
+// A file read and written with O_DIRECT. One aligned window of the file is kept in
+// memory: a write loads the window first, so the bytes around the written ones keep
+// what is on the disk, and the window goes back as whole blocks.
+class DirectFile
+{
+public:
+    static constexpr size_t capacity = 4 << 20;
+
+private:
+    static constexpr size_t blockSize = 4096;
+    int fd = -1;
+    char *buffer = nullptr;
+    u_int64_t windowStart = 0;
+    // bytes of the window that are in the file or have been written
+    size_t windowValid = 0;
+    bool loaded = false;
+    bool dirty = false;
+    u_int64_t fileSize = 0;
+    void load(u_int64_t);
+
+public:
+    DirectFile() = default;
+    DirectFile(const DirectFile &) = delete;
+    DirectFile &operator=(const DirectFile &) = delete;
+    ~DirectFile();
+    // false if the file system does not support O_DIRECT
+    bool open(string, bool);
+    void close();
+    int getFd();
+    size_t read(u_int64_t, char *, size_t);
+    void write(u_int64_t, const char *, size_t);
+    void flush();
+    // turns [offset, offset + size) into a hole, false if the file system cannot
+    bool punch(u_int64_t, u_int64_t);
+    // bytes of the window, none while the file is closed
+    u_int64_t memoryUse();
+};
+
 class MetaData
 {
 public:
@@ -43,9 +164,40 @@ class ReadWAV : public MetaData
 private:
     ifstream file;
     string inputFileName;
-    const int sizeOfUnit = 44100;
+    int sizeOfUnit = 44100;
     u_int64_t remainingDataSize;
     struct WAVHeader *header;
+    // set by the job that owns the reader, getSamples throws once it is raised
+    const atomic<bool> *cancelled = nullptr;
+    // the mode asked for and the one the open file got
+    IOMode mode = IOMode::Buffered;
+    IOMode active = IOMode::Buffered;
+    DirectFile direct;
+    // descriptor beside the stream for page cache advice and hole lookups
+    int sideFd = -1;
+    u_int64_t position = 0;
+    u_int64_t advised = 0;
+    // the last region of the file looked up with SEEK_DATA / SEEK_HOLE
+    u_int64_t regionStart = 0;
+    u_int64_t regionEnd = 0;
+    bool regionHole = false;
+    bool lastBlockHole = false;
+    bool lastBlockSilent = false;
+    // A file at another rate is converted as it is read: header then describes the converted
+    // stream and fileHeader the file, outPos is the next converted sample and rawRemaining
+    // counts the samples of the file still to be read
+    ResampleQuality quality = ResampleQuality::Medium;
+    WAVHeader fileHeader;
+    unique_ptr<Resampler> resampler;
+    u_int64_t outPos = 0;
+    u_int64_t rawRemaining = 0;
+    vector<int16_t> raw;
+    int64_t tell();
+    void seek(u_int64_t);
+    void readData(char *, size_t);
+    bool inHole(u_int64_t, u_int64_t);
+    bool getConverted(vector<int16_t> &, int, int);
+    void restart(u_int64_t);
 
 public:
     ReadWAV() = default;
@@ -57,9 +209,29 @@ public:
     bool openWAVFile(string) override;
     bool closeWAVFile();
     int getUnitSize();
+    // samples getSamples() reads at a time, a second unless a pass is short of memory
+    void setUnitSize(int);
     int getSizeFile();
+    u_int64_t getSampleCount();
     uint32_t getSampleRate();
     WAVHeader *getHeader();
+    void setCancelFlag(const atomic<bool> *);
+    // positions the reader at sample first, getSamples then goes on from there up to sample last
+    void seekSample(u_int64_t, u_int64_t);
+    void setIOMode(IOMode);
+    // true if the last block of getSamples lay in a hole of the file and is all zeros
+    bool blockIsHole();
+    // true if the last block of getSamples is all zeros, read from a hole or not
+    bool blockIsSilent();
+    // descriptor the samples are read through, -1 if they are converted on the way
+    int getFd();
+    // true if the file is at another rate than pipelineRate and converted as it is read
+    bool isConverted();
+    // the preset the reader converts with from the next parseHead() on
+    void setResampleQuality(ResampleQuality);
+    ResampleQuality getResampleQuality();
+    // bytes of the buffers the open file needs for blocks of count samples
+    u_int64_t memoryUse(size_t);
 };
 
 class WriteWAV : public MetaData
@@ -67,6 +239,26 @@ class WriteWAV : public MetaData
 private:
     ofstream file;
     string outputFileName;
+    IOMode mode = IOMode::Buffered;
+    IOMode active = IOMode::Buffered;
+    DirectFile direct;
+    // descriptor beside the stream for writeback pacing and hole punching
+    int sideFd = -1;
+    u_int64_t position = 0;
+    // NoCache: writeback of [pacedFrom, pacedTo) has been started, the part before is on the disk
+    u_int64_t pacedFrom = 0;
+    u_int64_t pacedTo = 0;
+    // holes are punched until the file system refuses
+    bool sparse = true;
+    // samples are copied in the kernel until the file system refuses
+    bool copies = true;
+    int64_t tell();
+    void seek(u_int64_t);
+    void writeData(const char *, size_t);
+    void writeBytes(const char *, size_t);
+    void writeZeros(u_int64_t);
+    bool punch(u_int64_t, u_int64_t);
+    void pace();
 
 public:
     WriteWAV() = default;
@@ -75,8 +267,50 @@ public:
     bool closeWAVFile();
     void writeHead(ReadWAV &);
     void saveSamples(ReadWAV &, vector<int16_t> &, int);
+    // writes count zero samples from sample first on, as a hole where it can
+    void saveSilence(u_int64_t, u_int64_t);
+    // copies count samples of the reader's file from sample first on without reading them,
+    // returns how many were copied, 0 where the kernel cannot copy between the files
+    u_int64_t copySamples(ReadWAV &, u_int64_t, u_int64_t);
+    // next samples go after the first count samples of the data chunk
+    void seekSample(u_int64_t);
+    // flushes the written samples to the disk
+    void sync();
+    void setIOMode(IOMode);
+    // bytes of the buffers of the open file
+    u_int64_t memoryUse();
 };
 
+// Raw copies of plain values and of vectors of them, for converter state in checkpoints.
+// A checkpoint is only read back by the same build, so the layout is the one in memory.
+template <typename T>
+void writeRaw(ostream &out, const T &value)
+{
+    out.write((const char *)&value, sizeof(T));
+}
+
+template <typename T>
+void writeRaw(ostream &out, const vector<T> &values)
+{
+    writeRaw(out, (u_int64_t)values.size());
+    out.write((const char *)values.data(), values.size() * sizeof(T));
+}
+
+template <typename T>
+void readRaw(istream &in, T &value)
+{
+    in.read((char *)&value, sizeof(T));
+}
+
+template <typename T>
+void readRaw(istream &in, vector<T> &values)
+{
+    u_int64_t size = 0;
+    readRaw(in, size);
+    values.resize(size);
+    in.read((char *)values.data(), size * sizeof(T));
+}
+
 class Converter
 {
 private:
@@ -85,6 +319,46 @@ public:
     virtual ~Converter() = default;
     virtual void convert(string, string, ReadWAV &, WriteWAV &) = 0;
     virtual void help() = 0;
+    // canonical text of the command, used to build stage cache keys
+    virtual string describe() = 0;
+    // auxiliary files the converter reads besides its input stream
+    virtual vector<string> auxFiles() { return {}; }
+    // samples [first, second) the command can change, for a stream of the given sample rate
+    virtual pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) = 0;
+    // true if a change anywhere inside the affected range carries on to its end
+    virtual bool hasMemory() { return false; }
+    // copy of the command restricted to seconds [from, to) and shifted to start at 0,
+    // nullptr if the command does nothing there
+    virtual Converter *window(u_int32_t, u_int32_t) = 0;
+    // samples of an auxiliary file that are already in memory, used instead of reading the file
+    virtual void useAuxData(const string &, shared_ptr<const vector<int16_t>>) {}
+    // preset of the job, for auxiliary files at another rate that the command reads itself
+    virtual void useResampleQuality(ResampleQuality) {}
+    // Block interface. Streamable converters are run together in one pass over the file:
+    // prepare() is called before the first block, processBlock() gets the blocks in order
+    // together with the position of the first sample of the block in the stream
+    virtual bool isStreamable() { return false; }
+    virtual void prepare(u_int32_t) {}
+    virtual void processBlock(vector<int16_t> &, u_int64_t) {}
+    // A converter that looks ahead holds back latency() samples: its blocks come out shorter
+    // at first and flush() hands over what is left once the input has ended
+    virtual u_int32_t latency() { return 0; }
+    virtual void flush(vector<int16_t> &samples) { samples.clear(); }
+    // A converter that looks at its whole input before the first block gets the input
+    // file in analyze(), before prepare(). It can only be the first member of a pass.
+    virtual bool analyzesInput() { return false; }
+    virtual void analyze(string, ReadWAV &) {}
+    // State carried from one block to the next, written into checkpoints between blocks.
+    // loadState() is called after prepare() when a pass goes on from a checkpoint.
+    virtual void saveState(ostream &) {}
+    virtual void loadState(istream &) {}
+    // Called instead of processBlock() for a block of count zero samples at pos. True if the
+    // block stays all zeros and the state is kept up to date without running the kernel,
+    // false to have processBlock() run on the block as usual.
+    virtual bool processSilence(u_int64_t, size_t) { return false; }
+    // Bytes the converter holds while it runs on blocks of count samples of a stream at the
+    // given rate: delay lines, lookahead and read-ahead buffers. Known before prepare().
+    virtual u_int64_t memoryUse(u_int32_t, size_t) { return 0; }
 };
 
 class Mute : public Converter
@@ -92,12 +366,20 @@ class Mute : public Converter
 private:
     u_int32_t left;
     u_int32_t right;
+    u_int32_t sampleRate = 0;
 
 public:
     Mute(u_int32_t, u_int32_t);
     ~Mute() = default;
     void convert(string, string, ReadWAV &, WriteWAV &) override;
     void help() override;
+    string describe() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    bool isStreamable() override { return true; }
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    bool processSilence(u_int64_t, size_t) override { return true; }
 };
 
 class Mix : public Converter
@@ -105,13 +387,38 @@ class Mix : public Converter
 private:
     string nameSrcFile;
     u_int32_t start_with;
+    // seconds of the source file skipped before mixing
+    u_int32_t skip;
+    // samples of the source file if it is held in memory
+    shared_ptr<const vector<int16_t>> srcData;
+    ResampleQuality quality = ResampleQuality::Medium;
+    // block mode: source samples read ahead from the file, starting at source sample pendingStart
+    unique_ptr<ReadWAV> srcReader;
+    vector<int16_t> srcPending;
+    u_int64_t pendingStart = 0;
+    u_int64_t srcLength = 0;
+    u_int32_t sampleRate = 0;
     void avg_samples(vector<int16_t> &, vector<int16_t> &);
+    u_int64_t sourceLength();
 
 public:
-    Mix(string, u_int32_t);
+    Mix(string, u_int32_t, u_int32_t = 0);
     ~Mix() = default;
     void convert(string, string, ReadWAV &, WriteWAV &) override;
     void help() override;
+    string describe() override;
+    vector<string> auxFiles() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    void useAuxData(const string &, shared_ptr<const vector<int16_t>>) override;
+    void useResampleQuality(ResampleQuality) override;
+    bool isStreamable() override { return true; }
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    bool processSilence(u_int64_t, size_t) override;
+    void saveState(ostream &) override;
+    void loadState(istream &) override;
+    u_int64_t memoryUse(u_int32_t, size_t) override;
 };
 
 class Reverberation : public Converter
@@ -120,12 +427,487 @@ private:
     u_int32_t left;
     u_int32_t right;
     double koeff;
+    // block mode: the delay line and the stream it belongs to
+    vector<int16_t> delayedSamples;
+    // nonzero samples in the delay line, the echo has died out at 0
+    size_t audible = 0;
+    u_int32_t sampleRate = 0;
 
 public:
     Reverberation(u_int32_t, u_int32_t, double);
     ~Reverberation() = default;
     void convert(string, string, ReadWAV &, WriteWAV &) override;
     void help() override;
+    string describe() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    bool hasMemory() override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    bool isStreamable() override { return true; }
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    bool processSilence(u_int64_t, size_t) override;
+    void saveState(ostream &) override;
+    void loadState(istream &) override;
+    u_int64_t memoryUse(u_int32_t, size_t) override;
+};
+
+// Second-order section with coefficients normalized so that a0 = 1
+struct Biquad
+{
+    double b0, b1, b2, a1, a2;
+};
+
+// Highpass, lowpass, peaking and shelving filters as a cascade of biquads in
+// transposed direct form II. The sections run as a wavefront: at every step
+// section k works on sample t - k, so all sections of the cascade are computed
+// side by side in one vectorizable loop over fixed-size lanes.
+class Filter : public Converter
+{
+private:
+    static constexpr size_t lanes = 8;
+    string kind;
+    double freq;
+    double gain;
+    double q;
+    int order;
+    size_t count = 0;
+    alignas(64) array<double, lanes> b0{}, b1{}, b2{}, a1{}, a2{};
+    alignas(64) array<double, lanes> z1{}, z2{}, in{}, out{};
+    template <size_t width>
+    void runCascade(vector<int16_t> &);
+
+public:
+    Filter(string, double, double, double, int);
+    ~Filter() = default;
+    static vector<Biquad> design(string, double, double, double, int, u_int32_t);
+    void convert(string, string, ReadWAV &, WriteWAV &) override;
+    void help() override;
+    string describe() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    bool hasMemory() override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    bool isStreamable() override { return true; }
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    bool processSilence(u_int64_t, size_t) override;
+    void saveState(ostream &) override;
+    void loadState(istream &) override;
+};
+
+// Lookahead limiter keeping the true peak of the output under a ceiling.
+// The peak of every sample is estimated with 4x oversampling, the gain it needs
+// is held over the lookahead window by a sliding minimum (monotonic deque) and
+// smoothed with a moving average over the attack time, which is never longer than
+// the lookahead, so the gain is fully down before the peak leaves the delay line.
+class Limiter : public Converter
+{
+private:
+    static constexpr int taps = 8;
+    static constexpr int phases = 4;
+    double ceilingDb;
+    double lookaheadMs;
+    double attackMs;
+    double releaseMs;
+    double ceiling = 0.0;
+    double releaseCoef = 0.0;
+    u_int32_t lookahead = 0;
+    u_int32_t attack = 0;
+    array<array<double, taps>, phases> interp{};
+    // input samples from index audioStart on, the first ones are context for the interpolation
+    vector<int16_t> audio;
+    int64_t audioStart = 0;
+    int64_t nextDetect = 0;
+    int64_t nextOut = 0;
+    // monotonic deque of (index, required gain) in a ring buffer
+    vector<pair<int64_t, double>> minQueue;
+    size_t head = 0;
+    size_t tail = 0;
+    // moving average of the held gain
+    vector<double> held;
+    size_t heldPos = 0;
+    double heldSum = 0.0;
+    double gain = 1.0;
+    vector<double> gains;
+    double requiredGain(int64_t);
+
+public:
+    Limiter(double, double, double, double);
+    ~Limiter() = default;
+    void convert(string, string, ReadWAV &, WriteWAV &) override;
+    void help() override;
+    string describe() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    bool hasMemory() override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    bool isStreamable() override { return true; }
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    u_int32_t latency() override;
+    void flush(vector<int16_t> &) override;
+    void saveState(ostream &) override;
+    void loadState(istream &) override;
+    u_int64_t memoryUse(u_int32_t, size_t) override;
+};
+
+// Radix-2 FFT of one size with the twiddles and the bit reversal permutation
+// computed up front. Plans are built once per size and shared by everyone.
+class FFTPlan
+{
+private:
+    size_t size;
+    vector<complex<double>> twiddles;
+    vector<u_int32_t> reversed;
+    void transform(vector<complex<double>> &, bool) const;
+
+public:
+    FFTPlan(size_t);
+    ~FFTPlan() = default;
+    static shared_ptr<const FFTPlan> get(size_t);
+    size_t getSize() const;
+    void forward(vector<complex<double>> &) const;
+    void inverse(vector<complex<double>> &) const;
+};
+
+// Short-time Fourier transform of a stream with overlap-add resynthesis. Samples are
+// fed as they arrive, every hop samples a frame is analysed with a sqrt-Hann window,
+// handed to a callback as frameSize / 2 + 1 bins and added back into the output.
+// The real frame is packed into a complex one of half the size for the transforms.
+class STFT
+{
+private:
+    size_t frameSize;
+    size_t hop;
+    shared_ptr<const FFTPlan> plan;
+    vector<double> window;
+    vector<complex<double>> twiddles;
+    vector<double> input;
+    vector<double> overlap;
+    vector<complex<double>> packed;
+    vector<complex<double>> spectrum;
+    size_t fresh = 0;
+
+public:
+    STFT(size_t, size_t);
+    ~STFT() = default;
+    void reset();
+    size_t latency();
+    void saveState(ostream &);
+    void loadState(istream &);
+    // appends one resynthesized sample to out for every sample fed, latency() samples late
+    void process(const int16_t *, size_t, vector<double> &, const function<void(vector<complex<double>> &)> &);
+};
+
+// Spectral noise gate. The noise spectrum is learned from seconds [from, to) of the
+// input; bins that stay close to it are turned down by the reduction, with the gains
+// smoothed over neighbouring bins and over time to avoid musical noise.
+class Denoise : public Converter
+{
+private:
+    static constexpr size_t frameSize = 2048;
+    static constexpr size_t hop = 512;
+    u_int32_t from;
+    u_int32_t to;
+    double reductionDb;
+    STFT stft;
+    vector<double> noise;
+    vector<double> gains;
+    vector<double> mask;
+    vector<double> resynth;
+    u_int64_t skip = 0;
+    u_int64_t pending = 0;
+    void gate(vector<complex<double>> &);
+
+public:
+    Denoise(u_int32_t, u_int32_t, double);
+    ~Denoise() = default;
+    void learnNoise(const vector<int16_t> &);
+    bool isStreamable() override { return true; }
+    bool analyzesInput() override { return true; }
+    void analyze(string, ReadWAV &) override;
+    void convert(string, string, ReadWAV &, WriteWAV &) override;
+    void help() override;
+    string describe() override;
+    pair<u_int64_t, u_int64_t> affectedRange(u_int32_t) override;
+    bool hasMemory() override;
+    Converter *window(u_int32_t, u_int32_t) override;
+    void prepare(u_int32_t) override;
+    void processBlock(vector<int16_t> &, u_int64_t) override;
+    u_int32_t latency() override;
+    void flush(vector<int16_t> &) override;
+    void saveState(ostream &) override;
+    void loadState(istream &) override;
+    u_int64_t memoryUse(u_int32_t, size_t) override;
+};
+
+// Where a job was when its last checkpoint was written: the group of stages running,
+// its input and output files, the samples read and written so far and the state of
+// the members of the pass
+struct CheckpointState
+{
+    pair<size_t, size_t> group{0, 0};
+    string inputName;
+    string outputName;
+    u_int64_t read = 0;
+    u_int64_t written = 0;
+    vector<u_int64_t> positions;
+    vector<string> states;
+};
+
+// Checkpoints of a job run with --checkpoint, kept in its work dir next to the output. One is
+// written whenever a group of stages starts and then every interval seconds inside a pass,
+// a killed job goes on from the last one with --resume.
+class Checkpoint
+{
+private:
+    fs::path dir;
+    string key;
+    chrono::seconds interval;
+    chrono::steady_clock::time_point last;
+    bool resuming = false;
+    bool stored = false;
+
+public:
+    CheckpointState state;
+    Checkpoint(fs::path, string, u_int32_t);
+    ~Checkpoint() = default;
+    // reads the checkpoint left by an earlier run of the same job, false if there is none
+    bool load();
+    bool isResuming();
+    void resumed();
+    void startGroup(pair<size_t, size_t>, string, string);
+    bool due();
+    void save();
+    void clear();
+    // whether the dir holds a checkpoint of this job, written by this run or an earlier one
+    bool hasState();
+};
+
+// Bounded single-producer single-consumer queue. Each index sits on a cache line of its own
+// together with the copy of the other index its side keeps, which is read again only when
+// the queue looks full or empty.
+template <typename T>
+class SpscRing
+{
+private:
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> tail{0};
+    size_t cachedHead = 0;
+    alignas(64) atomic<size_t> head{0};
+    size_t cachedTail = 0;
+
+public:
+    SpscRing(size_t capacity) : slots(bit_ceil(max(capacity, (size_t)2))), mask(slots.size() - 1) {}
+    size_t capacity() const { return this->slots.size(); }
+    size_t size() const { return this->tail.load(memory_order_acquire) - this->head.load(memory_order_acquire); }
+
+    // producer side, false if the queue is full
+    bool tryPush(T &value)
+    {
+        const size_t at = this->tail.load(memory_order_relaxed);
+        if (at - this->cachedHead == this->slots.size())
+        {
+            this->cachedHead = this->head.load(memory_order_acquire);
+            if (at - this->cachedHead == this->slots.size())
+                return false;
+        }
+        this->slots[at & this->mask] = move(value);
+        this->tail.store(at + 1, memory_order_release);
+        return true;
+    }
+
+    // consumer side, false if the queue is empty
+    bool tryPop(T &value)
+    {
+        const size_t at = this->head.load(memory_order_relaxed);
+        if (at == this->cachedTail)
+        {
+            this->cachedTail = this->tail.load(memory_order_acquire);
+            if (at == this->cachedTail)
+                return false;
+        }
+        value = move(this->slots[at & this->mask]);
+        this->head.store(at + 1, memory_order_release);
+        return true;
+    }
+};
+
+// Memory of the engine counted against the limit of --mem-limit, one budget for the
+// whole process. Passes charge their blocks, the state of their members and their I/O
+// buffers, the daemon its cache of $n files. A charge always goes through: the limit is
+// kept by passes that take smaller blocks when little is free and by jobs that wait in
+// admit() until what they need at least is free.
+class MemoryBudget
+{
+private:
+    mutex lock;
+    condition_variable released;
+    // 0 for no limit
+    u_int64_t limit = 0;
+    u_int64_t used = 0;
+    u_int64_t peak = 0;
+    // jobs admitted and not finished, jobs waiting and the ones that had to wait
+    size_t jobs = 0;
+    size_t waiting = 0;
+    u_int64_t waited = 0;
+    friend class MemoryLease;
+
+public:
+    MemoryBudget() = default;
+    ~MemoryBudget() = default;
+    static MemoryBudget &global();
+    void setLimit(u_int64_t);
+    u_int64_t getLimit();
+    u_int64_t getUsed();
+    u_int64_t getPeak();
+    size_t getWaiting();
+    void charge(u_int64_t);
+    void release(u_int64_t);
+    // bytes free under the limit, as good as unlimited without one
+    u_int64_t available();
+    // used, peak and limit in MB and the jobs that waited, for the end of a job
+    string report();
+};
+
+// Bytes charged to the budget of the process for as long as the lease lives
+class MemoryLease
+{
+private:
+    u_int64_t bytes = 0;
+    bool job = false;
+
+public:
+    MemoryLease() = default;
+    MemoryLease(const MemoryLease &) = delete;
+    MemoryLease &operator=(const MemoryLease &) = delete;
+    ~MemoryLease();
+    // charges or releases the difference
+    void resize(u_int64_t);
+    // resizes only if the new size fits under the limit, false if it does not
+    bool tryResize(u_int64_t);
+    u_int64_t size();
+    // Makes the lease the one of a job: waits until bytes fit under the limit, or until no
+    // other job is admitted, and charges them. False if cancelled is raised meanwhile.
+    bool admit(u_int64_t, const atomic<bool> * = nullptr);
+};
+
+// Stage threads of a pass: the members are split into at most threads groups of
+// consecutive converters, each run on a thread of its own (0 runs the pass on the calling
+// thread), with depth blocks queued between neighbours and threads pinned to cores if pin is set
+struct PipelineConfig
+{
+    size_t threads = 0;
+    size_t depth = 4;
+    bool pin = false;
+};
+
+// A block on its way through the stage threads, end marks the end of the input and
+// [pos, pos + count) are the samples of the input it was read from. Held blocks were
+// flushed at the end and go through every later member.
+struct PipeBlock
+{
+    vector<int16_t> samples;
+    bool end = false;
+    bool silent = false;
+    u_int64_t pos = 0;
+    u_int64_t count = 0;
+    bool held = false;
+};
+
+// Intervals [begin, end) of the timeline with a value each, for the values active at a
+// position. The intervals are sorted by begin and seen as a balanced tree, the middle
+// of every range being its root, each root keeping the largest end below it.
+class IntervalIndex
+{
+private:
+    struct Interval
+    {
+        u_int64_t begin;
+        u_int64_t end;
+        size_t value;
+    };
+    vector<Interval> intervals;
+    vector<u_int64_t> maxEnd;
+    u_int64_t build(size_t, size_t);
+    void collect(size_t, size_t, u_int64_t, u_int64_t, vector<size_t> &) const;
+
+public:
+    IntervalIndex() = default;
+    ~IntervalIndex() = default;
+    // empty intervals are left out
+    void add(u_int64_t, u_int64_t, size_t);
+    // sorts the intervals added, before any lookup
+    void build();
+    // values of the intervals that overlap [begin, end), in ascending order
+    void overlapping(u_int64_t, u_int64_t, vector<size_t> &) const;
+    // first position from pos on that an interval covers, UINT64_MAX if there is none
+    u_int64_t nextCovered(u_int64_t) const;
+};
+
+// Blocks a pass has run, the ones that came in silent, and the member runs it saved
+// on silence and outside the ranges of the members
+struct PassStats
+{
+    u_int64_t blocks = 0;
+    u_int64_t silentBlocks = 0;
+    u_int64_t skippedRuns = 0;
+    u_int64_t idleRuns = 0;
+};
+
+// Runs consecutive streamable converters together in one read/process/write pass
+class StreamPass
+{
+private:
+    vector<Converter *> members;
+    Checkpoint *checkpoint = nullptr;
+    PipelineConfig pipeline;
+    MemoryLease *memory = nullptr;
+    // silent blocks read and written and the kernel runs every member skipped on them
+    u_int64_t silentRead = 0;
+    u_int64_t silentWritten = 0;
+    u_int64_t blocksRead = 0;
+    vector<u_int64_t> skipped;
+    // the read positions every member can change, and the runs and samples that needed none
+    IntervalIndex timeline;
+    vector<u_int64_t> idle;
+    u_int64_t copied = 0;
+    // positions and active members of the blocks given to feed()
+    vector<u_int64_t> feedPositions;
+    vector<char> feedActive;
+    vector<size_t> feedFound;
+    void buildTimeline(u_int32_t);
+    void activeMembers(u_int64_t, u_int64_t, vector<char> &, vector<size_t> &);
+    bool processMembers(vector<int16_t> &, bool, size_t, size_t, vector<u_int64_t> &, const vector<char> &);
+    void saveCheckpoint(vector<u_int64_t> &, u_int64_t, WriteWAV &);
+    void restoreCheckpoint(vector<u_int64_t> &, u_int64_t &, ReadWAV &, WriteWAV &, string);
+    void runPipeline(vector<u_int64_t> &, u_int64_t &, ReadWAV &, WriteWAV &);
+
+public:
+    // blocks of a second, halved while the pass does not fit as long as they stay minBlock
+    // samples or more
+    static constexpr size_t minBlock = 4096;
+    static size_t smallestBlock(u_int32_t);
+    StreamPass() = default;
+    ~StreamPass() = default;
+    void add(Converter *);
+    void setCheckpoint(Checkpoint *);
+    void setPipeline(PipelineConfig);
+    // the lease of the job the pass runs in, the pass resizes it to what it holds
+    void setMemory(MemoryLease *);
+    void run(string, string, ReadWAV &, WriteWAV &);
+    // Block by block without files: begin() prepares the members for a rate, feed() runs
+    // the next block of the input through them, finish() leaves the samples held back
+    void begin(u_int32_t);
+    void feed(vector<int16_t> &);
+    void finish(vector<int16_t> &);
+    PassStats getStats() const;
+    // splits stages[first, end) into groups run by one convert() or one shared pass
+    static vector<pair<size_t, size_t>> plan(vector<Converter *> &, size_t, bool);
+    static void runGroup(vector<Converter *> &, pair<size_t, size_t>, string, string, ReadWAV &, WriteWAV &,
+                         Checkpoint * = nullptr, PipelineConfig = PipelineConfig(), MemoryLease * = nullptr);
+    // bytes the members of stages[group) and the blocks in flight take with blocks of count
+    // samples at the given rate, the files of the pass not included
+    static u_int64_t memoryNeed(vector<Converter *> &, pair<size_t, size_t>, u_int32_t, size_t, PipelineConfig);
 };
 
 class Creater
@@ -160,21 +942,115 @@ public:
     Converter *creatConverter(u_int32_t, u_int32_t, double);
 };
 
+class FilterCreater : public Creater
+{
+private:
+public:
+    FilterCreater() = default;
+    Converter *creatConverter(string, double, double, double, int);
+};
+
+class LimiterCreater : public Creater
+{
+private:
+public:
+    LimiterCreater() = default;
+    Converter *creatConverter(double, double, double, double);
+};
+
+class DenoiseCreater : public Creater
+{
+private:
+public:
+    DenoiseCreater() = default;
+    Converter *creatConverter(u_int32_t, u_int32_t, double);
+};
+
 class ParseCmdLineArg
 {
 private:
     vector<string> args;
+    // long options ("--name" or "--name=value"), removed from args
+    vector<string> options;
     string confFileName;
     bool mode;
+    // "-g graph.txt in.wav ..." names no output, the graph file does
+    bool graph = false;
+    size_t mainIndex = 4;
 
 public:
     ParseCmdLineArg(int, char **);
+    ParseCmdLineArg(vector<string>);
     ~ParseCmdLineArg() = default;
     string getConfFileName();
     string getInWAVFileName(int);
     string getOutWAVFileName();
     string getMainWAVFileName();
     bool getMode();
+    bool isGraph();
+    bool hasOption(string);
+    string getOption(string, string);
+    // value of a "--name=N" option in [low, high], the default if the option has no value
+    u_int64_t getNumberOption(string, u_int64_t, u_int64_t = 0, u_int64_t = UINT64_MAX);
+    vector<string> getOptions();
+    int getInWAVFileCount();
+};
+
+// Cache of intermediate stage outputs shared between runs.
+// The key of stage k chains the key of stage k - 1 with the command text
+// and the identities of its auxiliary files, so equal config prefixes over
+// the same input map to the same cached file.
+class StageCache
+{
+private:
+    fs::path dir;
+    u_int64_t maxBytes;
+    bool enabled;
+    void evict();
+
+public:
+    StageCache(fs::path, u_int64_t, bool);
+    ~StageCache() = default;
+    static string hash(const string &);
+    static string fileIdentity(string);
+    string rootKey(string, ResampleQuality);
+    string nextKey(const string &, Converter *);
+    bool lookup(const string &, string);
+    void store(const string &, string);
+    bool isEnabled();
+};
+
+// A command of a finished render as recorded in the manifest next to the output
+struct RenderedCommand
+{
+    string signature;
+    u_int64_t begin;
+    u_int64_t end;
+    bool memory;
+};
+
+// Re-renders only the parts of an existing output that a config edit can change.
+// After every render the command list is saved to "<output>.render"; the next run
+// diffs it against the new list and re-renders the union of the dirty ranges.
+class IncrementalRender
+{
+private:
+    string outFileName;
+    string manifestName;
+    fs::path workDir;
+    bool fuse;
+    static string signature(Converter *);
+    bool loadManifest(string, u_int32_t &, vector<RenderedCommand> &);
+    vector<pair<u_int32_t, u_int32_t>> dirtyWindows(const vector<RenderedCommand> &,
+                                                    const vector<RenderedCommand> &, u_int32_t);
+    void renderWindow(string, u_int32_t, u_int32_t, vector<Converter *> &, ReadWAV &, WriteWAV &);
+
+public:
+    IncrementalRender(string, fs::path, bool);
+    ~IncrementalRender() = default;
+    static vector<RenderedCommand> describeCommands(vector<Converter *> &, u_int32_t);
+    bool update(string, vector<Converter *> &, ReadWAV &, WriteWAV &);
+    void save(string, vector<Converter *> &, u_int32_t);
 };
 
 class ParseConfigFile
@@ -186,6 +1062,159 @@ public:
     ParseConfigFile(string);
     ~ParseConfigFile() = default;
     queue<Converter *> parsing(ParseCmdLineArg &parseArgs);
+    queue<Converter *> parsing(istream &, ParseCmdLineArg &parseArgs);
+};
+
+// A stream of an effect graph: the input, the output of a converter fed by another stream,
+// or a merge that mixes a second stream into its source from mergeStart on (seconds in the
+// graph file, samples once the rate is known), as mix does with a file. Samples stay in the buffer until every consumer has taken them.
+struct GraphStream
+{
+    string name;
+    Converter *conv = nullptr;
+    size_t source = 0;
+    size_t merge = SIZE_MAX;
+    u_int64_t mergeStart = 0;
+    vector<int16_t> buffer;
+    // stream position of buffer[0]
+    u_int64_t bufferStart = 0;
+    // samples taken from the source so far
+    u_int64_t taken = 0;
+    bool finished = false;
+};
+
+// Renders several outputs of one input in a single pass over it. The graph file defines
+// streams as chains of commands on the input or on earlier streams and names the outputs:
+//     clean = input | highpass 80 4
+//     radio = clean | limiter -1 5 2 100
+//     both = clean | mix @radio 0
+//     out radio ./radio.wav
+// A stream used by several others is computed once and its blocks are shared.
+class EffectGraph
+{
+private:
+    vector<GraphStream> streams;
+    map<string, size_t> names;
+    vector<pair<size_t, string>> outputs;
+    // output files while they are written, removed if the render fails
+    vector<string> parts;
+    size_t lookup(const string &);
+    void pull(size_t, bool);
+    void trim(const vector<u_int64_t> &);
+
+public:
+    EffectGraph() = default;
+    EffectGraph(const EffectGraph &) = delete;
+    EffectGraph &operator=(const EffectGraph &) = delete;
+    ~EffectGraph();
+    void parse(istream &, ParseCmdLineArg &);
+    void run(string, ReadWAV &, IOMode);
+};
+
+// Decoded auxiliary files kept in memory between jobs, least recently used ones are dropped first
+class AuxCache
+{
+private:
+    mutex lock;
+    u_int64_t maxBytes;
+    u_int64_t usedBytes = 0;
+    list<pair<string, shared_ptr<const vector<int16_t>>>> entries;
+
+public:
+    AuxCache(u_int64_t);
+    ~AuxCache();
+    shared_ptr<const vector<int16_t>> get(string, ResampleQuality);
+};
+
+// One run of the pipeline over a main file. Temporary files live in a directory
+// of the job next to the output and are removed when the job ends.
+class Job
+{
+private:
+    ParseCmdLineArg &args;
+    queue<Converter *> convs;
+    fs::path workDir;
+    const atomic<bool> *cancelled;
+    AuxCache *auxCache;
+    // the work dir of a checkpointed job is kept when the job fails after a checkpoint, for --resume
+    bool checkpointing = false;
+    bool finished = false;
+    unique_ptr<Checkpoint> checkpoint;
+    // the work dir of a checkpointed job is locked, a second job of the same output fails
+    int lockFd = -1;
+    PipelineConfig pipeline;
+    // what the job holds of the memory budget, taken when it is admitted
+    MemoryLease memory;
+    void checkCancelled();
+    void runGroups(vector<Converter *> &, size_t, bool, pair<string, string> &, vector<string> &, StageCache &,
+                   Checkpoint *, ReadWAV &, WriteWAV &);
+
+public:
+    Job(ParseCmdLineArg &, queue<Converter *>, const atomic<bool> * = nullptr, AuxCache * = nullptr);
+    ~Job();
+    void run();
+};
+
+// A job submitted to the daemon
+struct ServerJob
+{
+    u_int64_t id;
+    vector<string> args;
+    string config;
+    atomic<bool> cancelled{false};
+    bool finished = false;
+    string result;
+    chrono::steady_clock::time_point submitted;
+    mutex lock;
+    condition_variable done;
+};
+
+// A connection to the daemon and the thread serving it. The fd stays open until the thread
+// is joined, so that it is never shut down after its number has been reused.
+struct ServerClient
+{
+    int fd;
+    thread worker;
+    atomic<bool> done{false};
+};
+
+// Daemon that runs jobs sent over a Unix domain socket on a pool of worker threads
+class Server
+{
+private:
+    // connections served at once, later ones wait in the listen backlog
+    static constexpr size_t maxClients = 256;
+    string socketName;
+    size_t workers;
+    atomic<bool> stopAsked{false};
+    list<unique_ptr<ServerClient>> clients;
+    AuxCache auxCache;
+    mutex lock;
+    condition_variable pending;
+    deque<shared_ptr<ServerJob>> jobs;
+    map<u_int64_t, shared_ptr<ServerJob>> active;
+    u_int64_t nextId = 1;
+    size_t running = 0;
+    u_int64_t completed = 0;
+    u_int64_t failed = 0;
+    u_int64_t cancelledJobs = 0;
+    deque<double> latencies;
+    bool stopping = false;
+    void workerLoop();
+    void handleClient(ServerClient *);
+    // joins the client threads that are done, or all of them
+    void joinClients(bool);
+    shared_ptr<ServerJob> submit(istream &);
+    string cancel(u_int64_t);
+    string stats();
+
+public:
+    Server(string, size_t, u_int64_t);
+    ~Server() = default;
+    void serve();
+    // makes serve() return as SIGINT and SIGTERM do, from another thread
+    void stop();
+    static string request(string, string);
 };
 
 class Main
@@ -196,4 +1225,6 @@ public:
     void soundProcessing(int, char **);
     void helpPrint();
     void processing(int, char **);
+    void submitJob(ParseCmdLineArg &);
+    void renderGraph(ParseCmdLineArg &);
 };
\ No newline at end of file
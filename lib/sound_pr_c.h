@@ -0,0 +1,85 @@
+#ifndef SOUND_PR_C_H
+#define SOUND_PR_C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * C interface of the sound processor, built as the shared library libsound_processor.
+ * A pipeline is made from the text of a config and runs 16-bit mono PCM held by the
+ * caller, block by block, without touching the file system. Every function but
+ * sp_destroy() returns 0 on success and -1 on an error, which sp_last_error() describes.
+ * A pipeline is used by one thread at a time.
+ */
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define SP_API __attribute__((visibility("default")))
+
+/* Raised when a function changes or a struct loses a field */
+#define SP_API_VERSION 1
+
+typedef struct sp_pipeline sp_pipeline;
+
+/* Samples of the source $n of the config (sources[n - 1]), at the rate of the pipeline */
+typedef struct
+{
+    const int16_t *samples;
+    size_t count;
+} sp_source;
+
+typedef struct
+{
+    uint64_t samples_in;
+    uint64_t samples_out;
+    /* blocks run, and the ones that came in silent */
+    uint64_t blocks;
+    uint64_t silent_blocks;
+    /* command runs left out on silence and on blocks outside the range of the command */
+    uint64_t skipped_runs;
+    uint64_t idle_runs;
+} sp_stats;
+
+SP_API int sp_api_version(void);
+
+/*
+ * Parses the config text and prepares its commands for sample_rate. The sources are
+ * copied, the caller may free them afterwards. Commands that read their whole input
+ * first (denoise) cannot run here. On failure NULL is returned and the reason is
+ * written to error, if there is one.
+ */
+SP_API sp_pipeline *sp_create(const char *config, uint32_t sample_rate, const sp_source *sources,
+                              size_t source_count, char *error, size_t error_size);
+
+/*
+ * Runs count samples of in through the pipeline. What comes out is written to out,
+ * which has room for count samples and may be in itself; *produced tells how many.
+ * Fewer samples than were given come out while the latency is filling up.
+ */
+SP_API int sp_process(sp_pipeline *pipeline, const int16_t *in, size_t count, int16_t *out, size_t *produced);
+
+/*
+ * Ends the input and writes the samples held back to out, at most sp_latency() of them.
+ * out needs room for sp_latency() samples; with less nothing is flushed and the call
+ * fails, so that it can be made again. The pipeline takes no input after a flush.
+ */
+SP_API int sp_flush(sp_pipeline *pipeline, int16_t *out, size_t capacity, size_t *produced);
+
+/* Samples the pipeline holds back, the sum of the latencies of its commands */
+SP_API uint32_t sp_latency(const sp_pipeline *pipeline);
+
+SP_API int sp_get_stats(const sp_pipeline *pipeline, sp_stats *stats);
+
+/* The last error of the pipeline, empty if there was none */
+SP_API const char *sp_last_error(const sp_pipeline *pipeline);
+
+SP_API void sp_destroy(sp_pipeline *pipeline);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,148 @@
+#include "./sound_pr.hpp"
+
+// Implementation of StageCache class methods
+
+StageCache::StageCache(fs::path dir, u_int64_t maxBytes, bool enabled)
+{
+    this->dir = dir;
+    this->maxBytes = maxBytes;
+    this->enabled = enabled;
+}
+
+bool StageCache::isEnabled()
+{
+    return this->enabled;
+}
+
+string StageCache::hash(const string &text)
+{
+    // 64-bit FNV-1a, printed as 16 hex digits
+    u_int64_t h = 14695981039346656037ULL;
+    for (unsigned char c : text)
+    {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+
+    ostringstream out;
+    out << hex << setw(16) << setfill('0') << h;
+    return out.str();
+}
+
+string StageCache::fileIdentity(string fileName)
+{
+    // A file is identified by its absolute path, size and modification time
+    error_code ec;
+    fs::path path = fs::absolute(fileName, ec);
+    u_int64_t size = fs::file_size(path, ec);
+    if (ec)
+        return path.string() + ":missing";
+
+    auto mtime = fs::last_write_time(path, ec).time_since_epoch().count();
+    return path.string() + ":" + to_string(size) + ":" + to_string(mtime);
+}
+
+string StageCache::rootKey(string mainFileName, ResampleQuality quality)
+{
+    // Files at another rate come out of the converter differently with every preset
+    string text = "input " + fileIdentity(mainFileName);
+    if (quality != ResampleQuality::Medium)
+        text += "\nresample " + to_string((int)quality);
+    return hash(text);
+}
+
+string StageCache::nextKey(const string &prevKey, Converter *conv)
+{
+    // Chains the previous key with the command and its auxiliary files
+    string text = prevKey + "\n" + conv->describe();
+    for (const string &aux : conv->auxFiles())
+        text += "\n" + fileIdentity(aux);
+
+    return hash(text);
+}
+
+bool StageCache::lookup(const string &key, string outFileName)
+{
+    // Copies the cached output of a stage to outFileName if it is present
+    if (!this->enabled)
+        return false;
+
+    fs::path entry = this->dir / (key + ".wav");
+    error_code ec;
+    if (!fs::exists(entry, ec))
+        return false;
+
+    fs::copy(entry, outFileName, fs::copy_options::overwrite_existing, ec);
+    if (ec)
+        return false;
+
+    // Hits refresh the entry so that eviction drops the least recently used ones
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    return true;
+}
+
+void StageCache::store(const string &key, string fileName)
+{
+    // Saves the output of a stage, the cache is best effort and never fails a run
+    if (!this->enabled)
+        return;
+
+    error_code ec;
+    fs::create_directories(this->dir, ec);
+
+    fs::path entry = this->dir / (key + ".wav");
+    // Concurrent jobs may store the same key, each writes its own part file
+    static atomic<u_int64_t> partCounter{0};
+    fs::path part = this->dir / (key + "." + to_string(getpid()) + "." + to_string(partCounter++) + ".part");
+    fs::copy(fileName, part, fs::copy_options::overwrite_existing, ec);
+    if (!ec)
+        fs::rename(part, entry, ec);
+    if (ec)
+    {
+        fs::remove(part, ec);
+        return;
+    }
+
+    this->evict();
+}
+
+void StageCache::evict()
+{
+    // Removes the least recently used entries until the cache fits into maxBytes
+    vector<pair<fs::file_time_type, fs::path>> entries;
+    u_int64_t total = 0;
+    error_code ec;
+
+    // Other jobs store and evict meanwhile, an entry that is gone or changing is skipped
+    for (fs::directory_iterator it(this->dir, ec), end; !ec && it != end; it.increment(ec))
+    {
+        const fs::directory_entry &entry = *it;
+        error_code entryEc;
+        if (!entry.is_regular_file(entryEc) || entryEc || entry.path().extension() != ".wav")
+            continue;
+
+        u_int64_t size = entry.file_size(entryEc);
+        if (entryEc)
+            continue;
+        fs::file_time_type time = entry.last_write_time(entryEc);
+        if (entryEc)
+            continue;
+
+        total += size;
+        entries.push_back({time, entry.path()});
+    }
+
+    sort(entries.begin(), entries.end());
+
+    for (const auto &[time, path] : entries)
+    {
+        if (total <= this->maxBytes)
+            break;
+
+        u_int64_t size = fs::file_size(path, ec);
+        if (ec)
+            continue;
+        if (fs::remove(path, ec))
+            total -= min(size, total);
+    }
+}
@@ -0,0 +1,195 @@
+#include "./sound_pr.hpp"
+
+// Implementation of FFTPlan class methods
+
+FFTPlan::FFTPlan(size_t size)
+{
+    if (size < 2 || (size & (size - 1)))
+        throw invalid_argument("The FFT size must be a power of two!\n");
+
+    this->size = size;
+
+    // Twiddles for the largest stage, smaller stages use every (size / len)-th one
+    this->twiddles.resize(size / 2);
+    for (size_t k = 0; k < size / 2; ++k)
+        this->twiddles[k] = polar(1.0, -2.0 * M_PI * k / size);
+
+    int bits = 0;
+    while (((size_t)1 << bits) < size)
+        ++bits;
+
+    this->reversed.resize(size);
+    for (size_t i = 0; i < size; ++i)
+    {
+        u_int32_t r = 0;
+        for (int b = 0; b < bits; ++b)
+            r |= ((i >> b) & 1) << (bits - 1 - b);
+        this->reversed[i] = r;
+    }
+}
+
+shared_ptr<const FFTPlan> FFTPlan::get(size_t size)
+{
+    // Returns the shared plan for the size, building it on first use
+    static mutex lock;
+    static map<size_t, shared_ptr<const FFTPlan>> plans;
+
+    lock_guard<mutex> guard(lock);
+    auto &plan = plans[size];
+    if (!plan)
+        plan = make_shared<const FFTPlan>(size);
+    return plan;
+}
+
+size_t FFTPlan::getSize() const
+{
+    return this->size;
+}
+
+void FFTPlan::transform(vector<complex<double>> &data, bool inverse) const
+{
+    // Iterative decimation in time
+    for (size_t i = 0; i < this->size; ++i)
+        if (i < this->reversed[i])
+            swap(data[i], data[this->reversed[i]]);
+
+    for (size_t len = 2; len <= this->size; len <<= 1)
+    {
+        const size_t half = len / 2;
+        const size_t stride = this->size / len;
+        for (size_t start = 0; start < this->size; start += len)
+        {
+            for (size_t k = 0; k < half; ++k)
+            {
+                complex<double> w = this->twiddles[k * stride];
+                if (inverse)
+                    w = conj(w);
+
+                complex<double> odd = w * data[start + k + half];
+                data[start + k + half] = data[start + k] - odd;
+                data[start + k] += odd;
+            }
+        }
+    }
+}
+
+void FFTPlan::forward(vector<complex<double>> &data) const
+{
+    this->transform(data, false);
+}
+
+void FFTPlan::inverse(vector<complex<double>> &data) const
+{
+    // Unscaled, the caller folds 1 / size into its synthesis window
+    this->transform(data, true);
+}
+
+// Implementation of STFT class methods
+
+STFT::STFT(size_t frameSize, size_t hop)
+{
+    this->frameSize = frameSize;
+    this->hop = hop;
+    this->plan = FFTPlan::get(frameSize / 2);
+
+    // sqrt of a periodic Hann window on both sides: the squares of the overlapping
+    // windows add up to frameSize / (2 * hop), which the synthesis scale removes
+    this->window.resize(frameSize);
+    for (size_t i = 0; i < frameSize; ++i)
+        this->window[i] = sqrt(0.5 - 0.5 * cos(2.0 * M_PI * i / frameSize));
+
+    // Twiddles that split the half size transform into the even and odd samples
+    this->twiddles.resize(frameSize / 2 + 1);
+    for (size_t k = 0; k <= frameSize / 2; ++k)
+        this->twiddles[k] = polar(1.0, -2.0 * M_PI * k / frameSize);
+
+    this->reset();
+}
+
+void STFT::reset()
+{
+    this->input.assign(this->frameSize, 0.0);
+    this->overlap.assign(this->frameSize, 0.0);
+    this->packed.resize(this->frameSize / 2);
+    this->spectrum.resize(this->frameSize / 2 + 1);
+    this->fresh = 0;
+}
+
+size_t STFT::latency()
+{
+    return this->frameSize - this->hop;
+}
+
+void STFT::saveState(ostream &out)
+{
+    writeRaw(out, this->input);
+    writeRaw(out, this->overlap);
+    writeRaw(out, this->fresh);
+}
+
+void STFT::loadState(istream &in)
+{
+    readRaw(in, this->input);
+    readRaw(in, this->overlap);
+    readRaw(in, this->fresh);
+}
+
+void STFT::process(const int16_t *samples, size_t count, vector<double> &out,
+                   const function<void(vector<complex<double>> &)> &processFrame)
+{
+    const size_t half = this->frameSize / 2;
+    const double scale = 2.0 * this->hop / this->frameSize / half;
+    const complex<double> i1(0.0, 1.0);
+
+    while (count > 0)
+    {
+        // Fill the newest part of the frame
+        size_t take = min(count, this->hop - this->fresh);
+        for (size_t i = 0; i < take; ++i)
+            this->input[this->frameSize - this->hop + this->fresh + i] = samples[i];
+        this->fresh += take;
+        samples += take;
+        count -= take;
+
+        if (this->fresh < this->hop)
+            break;
+
+        // Analysis: even samples go to the real part, odd ones to the imaginary part
+        for (size_t n = 0; n < half; ++n)
+            this->packed[n] = {this->input[2 * n] * this->window[2 * n],
+                               this->input[2 * n + 1] * this->window[2 * n + 1]};
+        this->plan->forward(this->packed);
+
+        for (size_t k = 0; k <= half; ++k)
+        {
+            complex<double> a = this->packed[k % half];
+            complex<double> b = conj(this->packed[(half - k) % half]);
+            this->spectrum[k] = 0.5 * (a + b) - 0.5 * i1 * this->twiddles[k] * (a - b);
+        }
+
+        processFrame(this->spectrum);
+
+        // Synthesis packs the bins the same way back
+        for (size_t k = 0; k < half; ++k)
+        {
+            complex<double> a = this->spectrum[k];
+            complex<double> b = conj(this->spectrum[half - k]);
+            this->packed[k] = 0.5 * (a + b) + 0.5 * i1 * conj(this->twiddles[k]) * (a - b);
+        }
+        this->plan->inverse(this->packed);
+
+        // Overlap-add, the first hop samples are then complete
+        for (size_t n = 0; n < half; ++n)
+        {
+            this->overlap[2 * n] += this->packed[n].real() * this->window[2 * n] * scale;
+            this->overlap[2 * n + 1] += this->packed[n].imag() * this->window[2 * n + 1] * scale;
+        }
+
+        out.insert(out.end(), this->overlap.begin(), this->overlap.begin() + this->hop);
+
+        move(this->overlap.begin() + this->hop, this->overlap.end(), this->overlap.begin());
+        fill(this->overlap.end() - this->hop, this->overlap.end(), 0.0);
+        move(this->input.begin() + this->hop, this->input.end(), this->input.begin());
+        this->fresh = 0;
+    }
+}
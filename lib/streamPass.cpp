@@ -0,0 +1,613 @@
+#include "./sound_pr.hpp"
+#include <pthread.h>
+
+// Time a stage of a pipeline spends on blocks and waiting on its neighbours
+struct StageStats
+{
+    chrono::nanoseconds busy{0};
+    chrono::nanoseconds waitIn{0};
+    chrono::nanoseconds waitOut{0};
+    // blocks queued in front of the stage, summed over the blocks it took
+    u_int64_t queued = 0;
+    u_int64_t blocks = 0;
+};
+
+// Waits until ready() holds, spinning briefly and then sleeping in short steps, and adds
+// the time to waited. False if the pipeline was aborted meanwhile.
+template <typename F>
+static bool waitUntil(F &&ready, const atomic<bool> &aborted, chrono::nanoseconds &waited)
+{
+    if (ready())
+        return true;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t spins = 0; !ready(); ++spins)
+    {
+        if (aborted.load(memory_order_relaxed))
+            return false;
+        if (spins < 64)
+            this_thread::yield();
+        else
+            this_thread::sleep_for(chrono::microseconds(20));
+    }
+    waited += chrono::steady_clock::now() - start;
+    return true;
+}
+
+// Implementation of StreamPass class methods
+
+void StreamPass::add(Converter *conv)
+{
+    this->members.push_back(conv);
+}
+
+void StreamPass::setCheckpoint(Checkpoint *checkpoint)
+{
+    this->checkpoint = checkpoint;
+}
+
+void StreamPass::setPipeline(PipelineConfig pipeline)
+{
+    this->pipeline = pipeline;
+}
+
+void StreamPass::setMemory(MemoryLease *memory)
+{
+    this->memory = memory;
+}
+
+size_t StreamPass::smallestBlock(u_int32_t sampleRate)
+{
+    size_t block = sampleRate;
+    while (block / 2 >= minBlock)
+        block /= 2;
+    return block;
+}
+
+u_int64_t StreamPass::memoryNeed(vector<Converter *> &stages, pair<size_t, size_t> group, u_int32_t sampleRate,
+                                 size_t count, PipelineConfig pipeline)
+{
+    u_int64_t bytes = 0;
+    for (size_t i = group.first; i < group.second; ++i)
+        bytes += stages[i]->memoryUse(sampleRate, count);
+
+    // With stage threads every slot of every ring may hold a block, and every thread one more
+    const size_t threads = min(pipeline.threads, group.second - group.first);
+    const u_int64_t blocks = threads > 0 ? (threads + 1) * (bit_ceil(max(pipeline.depth, (size_t)2)) + 1) + 1 : 1;
+    return bytes + blocks * count * sizeof(int16_t);
+}
+
+void StreamPass::run(string inFileName, string outFileName, ReadWAV &reader, WriteWAV &writer)
+{
+    // Logs the converters that share the pass
+    cout << "pass:";
+    for (Converter *conv : this->members)
+        cout << " [" << conv->describe() << "]";
+    cout << endl;
+
+    // Converters that look at the whole input first do it before the stream starts
+    for (Converter *conv : this->members)
+        if (conv->analyzesInput())
+            conv->analyze(inFileName, reader);
+
+    reader.openWAVFile(inFileName);
+    reader.parseHead();
+    reader.checkCorrect();
+
+    vector<u_int64_t> positions(this->members.size(), 0);
+    u_int64_t written = 0;
+    this->skipped.assign(this->members.size(), 0);
+    this->silentRead = this->silentWritten = this->blocksRead = 0;
+    this->idle.assign(this->members.size(), 0);
+    this->copied = 0;
+
+    for (Converter *conv : this->members)
+        conv->prepare(reader.getSampleRate());
+    this->buildTimeline(reader.getSampleRate());
+
+    if (this->checkpoint && this->checkpoint->isResuming())
+        this->restoreCheckpoint(positions, written, reader, writer, outFileName);
+    else
+    {
+        // The output is written from scratch: the header of the input, then the processed blocks
+        ofstream(outFileName, ios::binary | ios::trunc).close();
+        writer.openWAVFile(outFileName);
+        writer.writeHead(reader);
+    }
+
+    // Blocks of a second are halved while the pass does not fit in what is free of the
+    // memory budget, what the pass already holds counted as free. The smallest blocks are
+    // taken even if they do not fit.
+    MemoryLease local;
+    MemoryLease &lease = this->memory ? *this->memory : local;
+    const u_int32_t rate = reader.getSampleRate();
+    auto need = [&](size_t block)
+    {
+        return memoryNeed(this->members, {0, this->members.size()}, rate, block, this->pipeline) +
+               reader.memoryUse(block) + writer.memoryUse();
+    };
+    size_t block = rate;
+    while (block > smallestBlock(rate) && !lease.tryResize(need(block)))
+        block /= 2;
+    reader.setUnitSize(block);
+    lease.resize(need(block));
+    if (block < rate)
+        cout << "memory: blocks of " << block << " samples to stay under the limit" << endl;
+
+    if (this->pipeline.threads > 0 && !this->members.empty())
+        this->runPipeline(positions, written, reader, writer);
+    else
+    {
+        vector<int16_t> samples;
+        samples.reserve(reader.getUnitSize());
+        vector<char> active(this->members.size(), 0);
+        const vector<char> all(this->members.size(), 1);
+        vector<size_t> found;
+
+        while (true)
+        {
+            // Up to the next range of a member the input goes to the output as it is, copied
+            // in the kernel where it can be. Behind a latency the output lags and blocks go on.
+            const u_int64_t pos = positions[0];
+            const u_int64_t next = min(this->timeline.nextCovered(pos), reader.getSampleCount());
+            if (written == pos && next > pos && next - pos >= (u_int64_t)reader.getUnitSize())
+            {
+                const u_int64_t count = writer.copySamples(reader, pos, next - pos);
+                if (count > 0)
+                {
+                    reader.seekSample(pos + count, reader.getSampleCount());
+                    for (u_int64_t &position : positions)
+                        position += count;
+                    written += count;
+                    this->copied += count;
+
+                    if (this->checkpoint && this->checkpoint->due())
+                        this->saveCheckpoint(positions, written, writer);
+                    continue;
+                }
+            }
+
+            if (!reader.getSamples(samples, 0, reader.getSizeFile()))
+                break;
+            ++this->blocksRead;
+            this->silentRead += reader.blockIsSilent();
+            this->activeMembers(pos, samples.size(), active, found);
+
+            // A block still silent at the end is written as a hole where it can
+            if (this->processMembers(samples, reader.blockIsSilent(), 0, this->members.size(), positions, active))
+            {
+                writer.saveSilence(written, samples.size());
+                ++this->silentWritten;
+            }
+            else
+                writer.saveSamples(reader, samples, 0);
+            written += samples.size();
+
+            if (this->checkpoint && this->checkpoint->due())
+                this->saveCheckpoint(positions, written, writer);
+        }
+
+        // Held back samples go through the rest of the pass once the input has ended
+        for (size_t i = 0; i < this->members.size(); ++i)
+        {
+            this->members[i]->flush(samples);
+            this->processMembers(samples, false, i + 1, this->members.size(), positions, all);
+            writer.saveSamples(reader, samples, 0);
+        }
+    }
+
+    reader.closeWAVFile();
+    writer.closeWAVFile();
+
+    // How much of the stream was silence and how many kernel runs that saved
+    if (this->silentRead > 0 || this->silentWritten > 0)
+    {
+        cout << "silence: " << this->silentRead << " of " << this->blocksRead << " blocks read, "
+             << this->silentWritten << " written as holes, skipped";
+        for (size_t i = 0; i < this->members.size(); ++i)
+            cout << " [" << this->members[i]->describe() << "] " << this->skipped[i];
+        cout << endl;
+    }
+
+    // How much of the stream and of the member runs no member range reached
+    u_int64_t idleRuns = 0;
+    for (u_int64_t runs : this->idle)
+        idleRuns += runs;
+    if (this->copied > 0 || idleRuns > 0)
+        cout << "timeline: " << this->copied << " of " << reader.getSampleCount()
+             << " samples copied untouched, " << idleRuns << " of " << this->blocksRead * this->members.size()
+             << " member runs left out" << endl;
+}
+
+void StreamPass::begin(u_int32_t sampleRate)
+{
+    this->skipped.assign(this->members.size(), 0);
+    this->idle.assign(this->members.size(), 0);
+    this->silentRead = this->silentWritten = this->blocksRead = this->copied = 0;
+
+    for (Converter *conv : this->members)
+        conv->prepare(sampleRate);
+    this->buildTimeline(sampleRate);
+
+    this->feedPositions.assign(this->members.size(), 0);
+    this->feedActive.assign(this->members.size(), 0);
+    this->feedFound.clear();
+}
+
+void StreamPass::feed(vector<int16_t> &block)
+{
+    // The first member has been given every sample so far
+    const u_int64_t pos = this->members.empty() ? 0 : this->feedPositions[0];
+    const bool silent = isSilent(block);
+    ++this->blocksRead;
+    this->silentRead += silent;
+
+    // A block that stays silent is left as it came, all zeros
+    this->activeMembers(pos, block.size(), this->feedActive, this->feedFound);
+    this->silentWritten += this->processMembers(block, silent, 0, this->members.size(), this->feedPositions,
+                                                this->feedActive);
+}
+
+void StreamPass::finish(vector<int16_t> &block)
+{
+    // Held back samples go through the rest of the pass, as at the end of a file
+    const vector<char> all(this->members.size(), 1);
+    vector<int16_t> held;
+    block.clear();
+    for (size_t i = 0; i < this->members.size(); ++i)
+    {
+        this->members[i]->flush(held);
+        this->processMembers(held, false, i + 1, this->members.size(), this->feedPositions, all);
+        block.insert(block.end(), held.begin(), held.end());
+    }
+}
+
+PassStats StreamPass::getStats() const
+{
+    PassStats stats;
+    stats.blocks = this->blocksRead;
+    stats.silentBlocks = this->silentRead;
+    for (u_int64_t runs : this->skipped)
+        stats.skippedRuns += runs;
+    for (u_int64_t runs : this->idle)
+        stats.idleRuns += runs;
+    return stats;
+}
+
+void StreamPass::buildTimeline(u_int32_t sampleRate)
+{
+    // Members are indexed by the read positions of the blocks that can reach their range.
+    // Latencies before a member hold its samples back, so its range ends that much later.
+    this->timeline = IntervalIndex();
+    u_int64_t held = 0;
+    for (size_t i = 0; i < this->members.size(); ++i)
+    {
+        auto [begin, end] = this->members[i]->affectedRange(sampleRate);
+        this->timeline.add(begin, end + held, i);
+        held += this->members[i]->latency();
+    }
+    this->timeline.build();
+}
+
+void StreamPass::activeMembers(u_int64_t pos, u_int64_t count, vector<char> &active, vector<size_t> &found)
+{
+    // Only the flags of the last block are cleared, so a block costs the members it reaches
+    for (size_t i : found)
+        active[i] = 0;
+    this->timeline.overlapping(pos, pos + count, found);
+    for (size_t i : found)
+        active[i] = 1;
+}
+
+bool StreamPass::processMembers(vector<int16_t> &block, bool silent, size_t first, size_t last,
+                                vector<u_int64_t> &positions, const vector<char> &active)
+{
+    // Every member counts the samples it has been given, a member with latency
+    // hands fewer samples on at first, so the positions drift apart. A block outside
+    // the range of a member leaves it alone, and a silent block skips the kernels
+    // of the members that keep it silent.
+    for (size_t i = first; i < last && !block.empty(); ++i)
+    {
+        u_int64_t size = block.size();
+        if (!active[i])
+            ++this->idle[i];
+        else if (silent && this->members[i]->processSilence(positions[i], size))
+            ++this->skipped[i];
+        else
+        {
+            this->members[i]->processBlock(block, positions[i]);
+            silent = isSilent(block);
+        }
+        positions[i] += size;
+    }
+    return silent && !block.empty();
+}
+
+void StreamPass::runPipeline(vector<u_int64_t> &positions, u_int64_t &written, ReadWAV &reader, WriteWAV &writer)
+{
+    // The members are split into groups of consecutive converters as even as can be, one
+    // thread each. This thread reads, a writer thread writes, rings[g] feeds stage g and
+    // the last ring feeds the writer.
+    const size_t count = min(this->pipeline.threads, this->members.size());
+    vector<pair<size_t, size_t>> groups;
+    for (size_t g = 0; g < count; ++g)
+        groups.push_back({g * this->members.size() / count, (g + 1) * this->members.size() / count});
+
+    vector<unique_ptr<SpscRing<PipeBlock>>> rings;
+    for (size_t g = 0; g <= count; ++g)
+        rings.push_back(make_unique<SpscRing<PipeBlock>>(this->pipeline.depth));
+
+    atomic<bool> aborted{false};
+    atomic<u_int64_t> blocksWritten{0};
+    u_int64_t blocksSent = 0;
+    exception_ptr failure;
+    mutex failureLock;
+    vector<StageStats> stats(count + 1);
+
+    // The first failure stops every thread at its next wait and is rethrown here
+    auto fail = [&]()
+    {
+        lock_guard<mutex> guard(failureLock);
+        if (!failure)
+            failure = current_exception();
+        aborted = true;
+    };
+
+    auto stage = [&](size_t g)
+    {
+        try
+        {
+            SpscRing<PipeBlock> &in = *rings[g];
+            SpscRing<PipeBlock> &out = *rings[g + 1];
+            StageStats &stat = stats[g];
+            auto push = [&](PipeBlock &block)
+            { return waitUntil([&] { return out.tryPush(block); }, aborted, stat.waitOut); };
+
+            vector<char> active(this->members.size(), 0);
+            const vector<char> all(this->members.size(), 1);
+            vector<size_t> found;
+
+            PipeBlock block;
+            while (waitUntil([&] { return in.tryPop(block); }, aborted, stat.waitIn))
+            {
+                stat.queued += in.size() + 1;
+                ++stat.blocks;
+                auto start = chrono::steady_clock::now();
+
+                if (block.end)
+                {
+                    // Held back samples go through the rest of the group, then the end goes on
+                    for (size_t i = groups[g].first; i < groups[g].second; ++i)
+                    {
+                        PipeBlock held;
+                        held.held = true;
+                        this->members[i]->flush(held.samples);
+                        this->processMembers(held.samples, false, i + 1, groups[g].second, positions, all);
+                        if (!held.samples.empty() && !push(held))
+                            return;
+                    }
+                    stat.busy += chrono::steady_clock::now() - start;
+                    push(block);
+                    return;
+                }
+
+                if (!block.held)
+                    this->activeMembers(block.pos, block.count, active, found);
+                block.silent = this->processMembers(block.samples, block.silent, groups[g].first, groups[g].second,
+                                                    positions, block.held ? all : active);
+                stat.busy += chrono::steady_clock::now() - start;
+                if (!push(block))
+                    return;
+            }
+        }
+        catch (...)
+        {
+            fail();
+        }
+    };
+
+    auto drain = [&]()
+    {
+        try
+        {
+            StageStats &stat = stats[count];
+            PipeBlock block;
+            while (waitUntil([&] { return rings[count]->tryPop(block); }, aborted, stat.waitIn) && !block.end)
+            {
+                stat.queued += rings[count]->size() + 1;
+                ++stat.blocks;
+                auto start = chrono::steady_clock::now();
+                if (block.silent)
+                {
+                    writer.saveSilence(written, block.samples.size());
+                    ++this->silentWritten;
+                }
+                else
+                    writer.saveSamples(reader, block.samples, 0);
+                written += block.samples.size();
+                stat.busy += chrono::steady_clock::now() - start;
+                blocksWritten.fetch_add(1, memory_order_release);
+            }
+        }
+        catch (...)
+        {
+            fail();
+        }
+    };
+
+    // The stages change positions from here on
+    u_int64_t readPos = positions[0];
+    auto start = chrono::steady_clock::now();
+    vector<thread> threads;
+    for (size_t g = 0; g < count; ++g)
+    {
+        threads.emplace_back(stage, g);
+        if (this->pipeline.pin)
+        {
+            // Stage g on core g + 1, the reading thread keeps the others
+            cpu_set_t cores;
+            CPU_ZERO(&cores);
+            CPU_SET((g + 1) % max(1u, thread::hardware_concurrency()), &cores);
+            pthread_setaffinity_np(threads.back().native_handle(), sizeof(cores), &cores);
+        }
+    }
+    threads.emplace_back(drain);
+
+    try
+    {
+        vector<int16_t> samples;
+        chrono::nanoseconds waited{0};
+        while (reader.getSamples(samples, 0, reader.getSizeFile()))
+        {
+            ++this->blocksRead;
+            this->silentRead += reader.blockIsSilent();
+            const u_int64_t count = samples.size();
+            PipeBlock block{move(samples), false, reader.blockIsSilent(), readPos, count};
+            readPos += count;
+            if (!waitUntil([&] { return rings[0]->tryPush(block); }, aborted, waited))
+                break;
+            ++blocksSent;
+
+            // The stages are between blocks once all that was read has been written
+            if (this->checkpoint && this->checkpoint->due())
+            {
+                if (!waitUntil([&] { return blocksWritten.load(memory_order_acquire) == blocksSent; }, aborted, waited))
+                    break;
+                this->saveCheckpoint(positions, written, writer);
+            }
+        }
+
+        PipeBlock end{{}, true};
+        waitUntil([&] { return rings[0]->tryPush(end); }, aborted, waited);
+    }
+    catch (...)
+    {
+        fail();
+    }
+
+    for (thread &worker : threads)
+        worker.join();
+    if (failure)
+        rethrow_exception(failure);
+
+    // Share of the time every stage spent working and waiting, the busiest one holds the others up
+    const double total = max(1.0, (double)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    size_t slowest = 0;
+    for (size_t g = 0; g <= count; ++g)
+    {
+        const StageStats &stat = stats[g];
+        ostringstream line;
+        line << "pipeline: ";
+        if (g < count)
+            for (size_t i = groups[g].first; i < groups[g].second; ++i)
+                line << "[" << this->members[i]->describe() << "] ";
+        else
+            line << "writer ";
+        line << fixed << setprecision(0) << "busy " << 100.0 * stat.busy.count() / total
+             << "%, waiting for input " << 100.0 * stat.waitIn.count() / total
+             << "%, for output " << 100.0 * stat.waitOut.count() / total << "%, queue "
+             << setprecision(1) << (stat.blocks ? (double)stat.queued / stat.blocks : 0.0) << " of "
+             << rings[g]->capacity();
+        cout << line.str() << endl;
+
+        if (g < count && stat.busy > stats[slowest].busy)
+            slowest = g;
+    }
+    cout << "pipeline: slowest stage is " << slowest + 1 << " of " << count << endl;
+}
+
+void StreamPass::saveCheckpoint(vector<u_int64_t> &positions, u_int64_t written, WriteWAV &writer)
+{
+    // The output is on the disk before the checkpoint that counts its samples
+    writer.sync();
+
+    CheckpointState &state = this->checkpoint->state;
+    state.read = positions[0];
+    state.written = written;
+    state.positions = positions;
+    state.states.clear();
+    for (Converter *conv : this->members)
+    {
+        ostringstream out;
+        conv->saveState(out);
+        state.states.push_back(out.str());
+    }
+
+    this->checkpoint->save();
+}
+
+void StreamPass::restoreCheckpoint(vector<u_int64_t> &positions, u_int64_t &written, ReadWAV &reader,
+                                   WriteWAV &writer, string outFileName)
+{
+    const CheckpointState &state = this->checkpoint->state;
+    if (state.positions.size() != this->members.size() || state.states.size() != this->members.size())
+        throw runtime_error("The checkpoint does not match the pass!\n");
+
+    cout << "resume: going on from sample " << state.read << endl;
+
+    for (size_t i = 0; i < this->members.size(); ++i)
+    {
+        istringstream in(state.states[i]);
+        this->members[i]->loadState(in);
+    }
+    positions = state.positions;
+    written = state.written;
+
+    // Whatever was written after the checkpoint is cut off and written again
+    fs::resize_file(outFileName, sizeof(WAVHeader) + written * sizeof(int16_t));
+    writer.openWAVFile(outFileName);
+    writer.seekSample(written);
+    if (state.read > 0)
+        reader.seekSample(state.read, reader.getSampleCount());
+
+    this->checkpoint->resumed();
+}
+
+vector<pair<size_t, size_t>> StreamPass::plan(vector<Converter *> &stages, size_t first, bool fuse)
+{
+    vector<pair<size_t, size_t>> groups;
+    size_t i = first;
+    while (i < stages.size())
+    {
+        size_t j = i + 1;
+        if (fuse && stages[i]->isStreamable())
+            while (j < stages.size() && stages[j]->isStreamable() && !stages[j]->analyzesInput())
+                ++j;
+
+        groups.push_back({i, j});
+        i = j;
+    }
+
+    return groups;
+}
+
+void StreamPass::runGroup(vector<Converter *> &stages, pair<size_t, size_t> group,
+                          string inFileName, string outFileName, ReadWAV &reader, WriteWAV &writer,
+                          Checkpoint *checkpoint, PipelineConfig pipeline, MemoryLease *memory)
+{
+    // A single converter keeps its own convert(), a run of streamable ones shares a pass.
+    // Checkpoints are taken between blocks and stage threads run blocks, so with either of them
+    // every streamable converter runs as a pass, and so it does under a memory limit, where
+    // a pass sizes its blocks to fit. The convert() of a converter starts from a copy of its
+    // input, so an input at another rate goes through a pass, which reads it converted.
+    reader.openWAVFile(inFileName);
+    reader.parseHead();
+    const bool converted = reader.isConverted();
+    reader.closeWAVFile();
+
+    const bool limited = memory && MemoryBudget::global().getLimit() > 0;
+    if (group.second - group.first == 1 && !converted &&
+        !((checkpoint || pipeline.threads > 0 || limited) && stages[group.first]->isStreamable()))
+    {
+        stages[group.first]->convert(inFileName, outFileName, reader, writer);
+        return;
+    }
+
+    StreamPass pass;
+    for (size_t i = group.first; i < group.second; ++i)
+        pass.add(stages[i]);
+    pass.setCheckpoint(checkpoint);
+    pass.setPipeline(pipeline);
+    pass.setMemory(memory);
+    pass.run(inFileName, outFileName, reader, writer);
+}
@@ -0,0 +1,69 @@
+#include "./sound_pr.hpp"
+
+// Implementation of IntervalIndex class methods
+
+void IntervalIndex::add(u_int64_t begin, u_int64_t end, size_t value)
+{
+    if (begin < end)
+        this->intervals.push_back({begin, end, value});
+}
+
+void IntervalIndex::build()
+{
+    sort(this->intervals.begin(), this->intervals.end(),
+         [](const Interval &a, const Interval &b)
+         { return a.begin < b.begin; });
+    this->maxEnd.assign(this->intervals.size(), 0);
+    this->build(0, this->intervals.size());
+}
+
+u_int64_t IntervalIndex::build(size_t lo, size_t hi)
+{
+    // Returns the largest end of [lo, hi)
+    if (lo >= hi)
+        return 0;
+
+    const size_t mid = lo + (hi - lo) / 2;
+    this->maxEnd[mid] = max({this->intervals[mid].end, this->build(lo, mid), this->build(mid + 1, hi)});
+    return this->maxEnd[mid];
+}
+
+void IntervalIndex::collect(size_t lo, size_t hi, u_int64_t begin, u_int64_t end, vector<size_t> &out) const
+{
+    // A subtree whose intervals all end before begin is passed over, and so is the right
+    // half of one whose root starts at or after end
+    if (lo >= hi)
+        return;
+
+    const size_t mid = lo + (hi - lo) / 2;
+    if (this->maxEnd[mid] <= begin)
+        return;
+
+    this->collect(lo, mid, begin, end, out);
+    if (this->intervals[mid].begin >= end)
+        return;
+    if (this->intervals[mid].end > begin)
+        out.push_back(this->intervals[mid].value);
+    this->collect(mid + 1, hi, begin, end, out);
+}
+
+void IntervalIndex::overlapping(u_int64_t begin, u_int64_t end, vector<size_t> &out) const
+{
+    out.clear();
+    this->collect(0, this->intervals.size(), begin, end, out);
+    sort(out.begin(), out.end());
+}
+
+u_int64_t IntervalIndex::nextCovered(u_int64_t pos) const
+{
+    vector<size_t> found;
+    this->collect(0, this->intervals.size(), pos, pos + 1, found);
+    if (!found.empty())
+        return pos;
+
+    // Nothing covers pos, so the intervals that start before it have ended as well
+    auto next = upper_bound(this->intervals.begin(), this->intervals.end(), pos,
+                            [](u_int64_t p, const Interval &interval)
+                            { return p < interval.begin; });
+    return next == this->intervals.end() ? numeric_limits<u_int64_t>::max() : next->begin;
+}
@@ -5,6 +5,15 @@ using namespace std;
 int main(int argc, char **argv)
 {
     Main processor;
-    processor.processing(argc, argv);
+    try
+    {
+        processor.processing(argc, argv);
+    }
+    catch (const exception &e)
+    {
+        // Reaching here unwinds the stack, so the job removes its temporary files
+        cerr << e.what();
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file
@@ -1,5 +1,37 @@
 #include <gtest/gtest.h>
 #include "./lib/sound_pr.hpp"
+#include "./lib/sound_pr_c.h"
+
+// Writes samples as a mono 16 bit WAV file
+static void writeTestWAV(const fs::path &fileName, const vector<int16_t> &samples, u_int32_t rate = 44100)
+{
+    WAVHeader header = {{'R', 'I', 'F', 'F'}, 0, {'W', 'A', 'V', 'E'}, {'f', 'm', 't', ' '}, 16, 1, 1,
+                        rate, rate * 2, 2, 16, {'d', 'a', 't', 'a'}, (u_int32_t)(samples.size() * 2)};
+    header.chunkSize = sizeof(WAVHeader) - 8 + header.subchunk2Size;
+    ofstream fout(fileName, ios::binary);
+    fout.write((const char *)&header, sizeof(header));
+    fout.write((const char *)samples.data(), samples.size() * 2);
+}
+
+// A directory of a test under the temp dir, removed when the test ends, also when it fails
+class TestDir
+{
+private:
+    fs::path path;
+
+public:
+    TestDir(string name) : path(fs::temp_directory_path() / ("conv_test_" + name + "." + to_string(getpid())))
+    {
+        fs::create_directories(this->path);
+    }
+    ~TestDir()
+    {
+        error_code ec;
+        fs::remove_all(this->path, ec);
+    }
+    operator const fs::path &() const { return this->path; }
+    fs::path operator/(const fs::path &name) const { return this->path / name; }
+};
 
 TEST(CmdParser, cmdParserCorrectInput)
 {
@@ -174,6 +206,25 @@ TEST(CmdParser, cmdParserIncorrectInput4)
     delete[] argv;
 }
 
+TEST(CmdParser, NumberOptions)
+{
+    ParseCmdLineArg args(vector<string>{"./build/sound_pr", "-c", "./config.txt", "./output.wav", "./in.wav",
+                                        "--cache-size=64", "--pipeline", "--workers=0", "--mem-limit=10MB",
+                                        "--checkpoint=-1", "--pipeline-depth=99999999999999999999"});
+
+    // A flag without a value keeps the default, an absent option as well
+    EXPECT_EQ(args.getNumberOption("--cache-size", 1024, 1), 64u);
+    EXPECT_EQ(args.getNumberOption("--pipeline", 3, 1), 3u);
+    EXPECT_EQ(args.getNumberOption("--aux-cache-size", 256), 256u);
+
+    // Zero where it makes no sense, trailing units, signs and overflows are refused
+    EXPECT_THROW(args.getNumberOption("--workers", 4, 1), std::invalid_argument);
+    EXPECT_THROW(args.getNumberOption("--mem-limit", 0), std::invalid_argument);
+    EXPECT_THROW(args.getNumberOption("--checkpoint", 30, 1), std::invalid_argument);
+    EXPECT_THROW(args.getNumberOption("--pipeline-depth", 4, 1), std::invalid_argument);
+    EXPECT_THROW(args.getNumberOption("--cache-size", 1024, 1, 32), std::invalid_argument);
+}
+
 TEST(ConfigParser, CorrectCommand)
 {
     int argc = 7;
@@ -262,3 +313,984 @@ TEST(ConfigParser, IncorrectCommand2)
 
     delete[] argv;
 }
+
+
+TEST(Converters, AffectedRangeAndWindow)
+{
+    MuteCreater muteCreater;
+    ReverberationCreater revbCreater;
+
+    Converter *mute = muteCreater.creatConverter(2, 5);
+    EXPECT_EQ(mute->affectedRange(44100), (pair<u_int64_t, u_int64_t>{88200, 220500}));
+
+    Converter *muteWindow = mute->window(3, 10);
+    ASSERT_NE(muteWindow, nullptr);
+    EXPECT_EQ(muteWindow->describe(), "mute 0 2");
+    EXPECT_EQ(mute->window(5, 10), nullptr);
+
+    Converter *revb = revbCreater.creatConverter(4, 8, 0.5);
+    EXPECT_TRUE(revb->hasMemory());
+    EXPECT_EQ(revb->window(8, 10), nullptr);
+    EXPECT_THROW(revb->window(5, 10), std::logic_error);
+
+    delete mute;
+    delete muteWindow;
+    delete revb;
+}
+
+
+TEST(Converters, FilterBlocksAndResponse)
+{
+    FilterCreater filterCreater;
+    Converter *lowpass = filterCreater.creatConverter("lowpass", 1000, 0, 0, 5);
+    Converter *highpass = filterCreater.creatConverter("highpass", 1000, 0, 0, 4);
+
+    // A constant signal passes the lowpass and is removed by the highpass
+    vector<int16_t> dc(44100, 10000);
+    vector<int16_t> low = dc, high = dc;
+    lowpass->prepare(44100);
+    lowpass->processBlock(low, 0);
+    highpass->prepare(44100);
+    highpass->processBlock(high, 0);
+    EXPECT_NEAR(low.back(), 10000, 1);
+    EXPECT_NEAR(high.back(), 0, 1);
+
+    // The state carries over between blocks of any size
+    vector<int16_t> noise(5000);
+    for (size_t i = 0; i < noise.size(); ++i)
+        noise[i] = (int16_t)((i * 7919) % 20000) - 10000;
+
+    vector<int16_t> whole = noise;
+    lowpass->prepare(44100);
+    lowpass->processBlock(whole, 0);
+
+    vector<int16_t> pieces;
+    lowpass->prepare(44100);
+    for (size_t pos = 0; pos < noise.size(); pos += 3)
+    {
+        vector<int16_t> block(noise.begin() + pos, noise.begin() + min(pos + 3, noise.size()));
+        lowpass->processBlock(block, pos);
+        pieces.insert(pieces.end(), block.begin(), block.end());
+    }
+    EXPECT_EQ(whole, pieces);
+
+    delete lowpass;
+    delete highpass;
+}
+
+
+TEST(Converters, LimiterCeilingAndLatency)
+{
+    LimiterCreater limiterCreater;
+    Converter *limiter = limiterCreater.creatConverter(-6.0, 5.0, 2.0, 50.0);
+
+    vector<int16_t> input(20000);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = (int16_t)(30000 * sin(i * 0.3) * (i > 10000 ? 1.0 : 0.1));
+
+    // Blocks come out shorter by the latency, flush() returns the rest
+    limiter->prepare(44100);
+    vector<int16_t> output;
+    for (size_t pos = 0; pos < input.size(); pos += 4410)
+    {
+        vector<int16_t> block(input.begin() + pos, input.begin() + min(pos + 4410, input.size()));
+        limiter->processBlock(block, pos);
+        output.insert(output.end(), block.begin(), block.end());
+    }
+    vector<int16_t> tail;
+    limiter->flush(tail);
+    output.insert(output.end(), tail.begin(), tail.end());
+
+    ASSERT_EQ(output.size(), input.size());
+
+    // Quiet samples pass unchanged and in place, loud ones stay under the ceiling
+    const double ceiling = INT16_MAX * pow(10.0, -6.0 / 20.0);
+    for (size_t i = 0; i < 9000; ++i)
+        EXPECT_EQ(output[i], input[i]);
+    for (int16_t sample : output)
+        EXPECT_LE(abs(sample), ceiling);
+
+    delete limiter;
+}
+
+
+TEST(Converters, DenoiseGatesNoiseKeepsTone)
+{
+    // A second of noise alone, then the noise under a loud tone
+    vector<int16_t> input(88200);
+    u_int32_t seed = 1;
+    for (size_t i = 0; i < input.size(); ++i)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        double noise = ((int32_t)(seed >> 16) - 32768) / 32768.0 * 300.0;
+        double tone = i >= 44100 ? 10000 * sin(2 * M_PI * 1000 * i / 44100.0) : 0.0;
+        input[i] = (int16_t)(noise + tone);
+    }
+
+    auto run = [&](double reduction)
+    {
+        Denoise denoise(0, 1, reduction);
+        denoise.learnNoise(vector<int16_t>(input.begin(), input.begin() + 44100));
+        denoise.prepare(44100);
+
+        vector<int16_t> output;
+        for (size_t pos = 0; pos < input.size(); pos += 10000)
+        {
+            vector<int16_t> block(input.begin() + pos, input.begin() + min(pos + 10000, input.size()));
+            denoise.processBlock(block, pos);
+            output.insert(output.end(), block.begin(), block.end());
+        }
+        vector<int16_t> tail;
+        denoise.flush(tail);
+        output.insert(output.end(), tail.begin(), tail.end());
+        return output;
+    };
+
+    auto energy = [](const vector<int16_t> &samples, size_t from, size_t to)
+    {
+        double sum = 0.0;
+        for (size_t i = from; i < to; ++i)
+            sum += (double)samples[i] * samples[i];
+        return sum / (to - from);
+    };
+
+    // Without reduction the overlap-add gives the input back
+    vector<int16_t> same = run(0.0);
+    ASSERT_EQ(same.size(), input.size());
+    for (size_t i = 0; i < input.size(); ++i)
+        EXPECT_LE(abs(same[i] - input[i]), 1);
+
+    // With it the noise drops by more than 12 dB and the tone keeps its level
+    vector<int16_t> output = run(24.0);
+    ASSERT_EQ(output.size(), input.size());
+    EXPECT_LT(energy(output, 10000, 40000), energy(input, 10000, 40000) / 16);
+    EXPECT_NEAR(energy(output, 50000, 88000) / energy(input, 50000, 88000), 1.0, 0.05);
+}
+
+
+TEST(Converters, DenoiseRangePastTheEndReRenders)
+{
+    // Three seconds of noise with a tone in the last one, the noise range runs on to second 10
+    const TestDir dir("denoise");
+    vector<int16_t> samples(3 * 44100);
+    u_int32_t seed = 3;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        samples[i] = (int16_t)((int)(seed >> 24) - 128 + (i >= 2 * 44100 ? 8000 * sin(2 * M_PI * 440 * i / 44100) : 0));
+    }
+    writeTestWAV(dir / "in.wav", samples);
+
+    auto render = [&](string out, vector<string> options, bool mute)
+    {
+        vector<string> argList{"sound_pr", "-c", "config.txt", "--no-cache", dir / out, dir / "in.wav"};
+        argList.insert(argList.end(), options.begin(), options.end());
+        ParseCmdLineArg args(argList);
+        queue<Converter *> convs;
+        convs.push(new Denoise(0, 10, 18.0));
+        if (mute)
+            convs.push(new Mute(1, 2));
+        Job(args, convs).run();
+
+        ifstream fin(dir / out, ios::binary);
+        return string(istreambuf_iterator<char>(fin), {});
+    };
+
+    // An edit after the first render updates the output, the same as a render from scratch
+    render("out.wav", {}, false);
+    const string updated = render("out.wav", {}, true);
+    EXPECT_EQ(updated, render("full.wav", {"--no-incremental"}, true));
+    EXPECT_EQ(updated.size(), sizeof(WAVHeader) + samples.size() * 2);
+}
+
+
+TEST(Converters, StateRoundTripMatchesUninterrupted)
+{
+    vector<int16_t> input(44100 * 4);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = (int16_t)(12000 * sin(i * 0.05) + 9000 * sin(i * 0.31) * (i % 30000 > 15000));
+
+    auto makeChain = []()
+    {
+        return vector<Converter *>{
+            new Reverberation(0, 3, 0.3),
+            new Filter("highpass", 120, 0, 0, 5),
+            new Denoise(0, 1, 12),
+            new Limiter(-3, 5, 2, 50),
+        };
+    };
+
+    auto feed = [](Converter *conv, const vector<int16_t> &samples, size_t from, size_t to, vector<int16_t> &output)
+    {
+        for (size_t pos = from; pos < to; pos += 44100)
+        {
+            vector<int16_t> block(samples.begin() + pos, samples.begin() + min(pos + 44100, to));
+            conv->processBlock(block, pos);
+            output.insert(output.end(), block.begin(), block.end());
+        }
+    };
+
+    // Every converter runs once straight through, once stopped halfway and restored into a new one
+    vector<Converter *> whole = makeChain(), first = makeChain(), second = makeChain();
+    for (size_t i = 0; i < whole.size(); ++i)
+    {
+        if (auto *denoise = dynamic_cast<Denoise *>(whole[i]))
+        {
+            vector<int16_t> noise(input.begin(), input.begin() + 44100);
+            denoise->learnNoise(noise);
+            ((Denoise *)first[i])->learnNoise(noise);
+            ((Denoise *)second[i])->learnNoise(noise);
+        }
+
+        vector<int16_t> expected, resumed, tail;
+        whole[i]->prepare(44100);
+        feed(whole[i], input, 0, input.size(), expected);
+        whole[i]->flush(tail);
+        expected.insert(expected.end(), tail.begin(), tail.end());
+
+        first[i]->prepare(44100);
+        feed(first[i], input, 0, 88200, resumed);
+        stringstream state;
+        first[i]->saveState(state);
+
+        second[i]->prepare(44100);
+        second[i]->loadState(state);
+        feed(second[i], input, 88200, input.size(), resumed);
+        second[i]->flush(tail);
+        resumed.insert(resumed.end(), tail.begin(), tail.end());
+
+        EXPECT_EQ(resumed, expected) << whole[i]->describe();
+
+        delete whole[i];
+        delete first[i];
+        delete second[i];
+    }
+}
+
+
+TEST(WAVFiles, IOModesWriteTheSameBytes)
+{
+    // A file written sequentially, then patched in the middle at an unaligned offset
+    const TestDir dir("io");
+
+    vector<int16_t> samples(3 * 44100 + 123);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)(i * 7);
+    vector<int16_t> patch(1000, -5);
+
+    writeTestWAV(dir / "in.wav", samples);
+
+    vector<string> contents;
+    for (IOMode mode : {IOMode::Buffered, IOMode::Direct, IOMode::NoCache})
+    {
+        ReadWAV reader;
+        WriteWAV writer;
+        reader.setIOMode(mode);
+        writer.setIOMode(mode);
+
+        const string out = dir / "out.wav";
+        reader.openWAVFile(dir / "in.wav");
+        reader.parseHead();
+        ofstream(out, ios::binary | ios::trunc).close();
+        writer.openWAVFile(out);
+        writer.writeHead(reader);
+
+        vector<int16_t> block;
+        while (reader.getSamples(block, 0, reader.getSizeFile()))
+            writer.saveSamples(reader, block, 0);
+        reader.closeWAVFile();
+        writer.closeWAVFile();
+
+        writer.openWAVFile(out);
+        writer.seekSample(44100 + 77);
+        writer.saveSamples(reader, patch, 0);
+        writer.closeWAVFile();
+
+        ifstream fin(out, ios::binary);
+        contents.emplace_back(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    }
+
+    ASSERT_EQ(contents[0].size(), sizeof(WAVHeader) + samples.size() * 2);
+    EXPECT_EQ(contents[1], contents[0]);
+    EXPECT_EQ(contents[2], contents[0]);
+    EXPECT_EQ(*(int16_t *)(contents[0].data() + sizeof(WAVHeader) + (44100 + 77) * 2), -5);
+}
+
+TEST(WAVFiles, MuteLeavesAHole)
+{
+    // Eight seconds of a tone with seconds 2 to 6 muted
+    const TestDir dir("hole");
+
+    vector<int16_t> samples(8 * 44100);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)(8000 * sin(2 * M_PI * 440 * i / 44100));
+
+    writeTestWAV(dir / "in.wav", samples);
+
+    ReadWAV reader;
+    WriteWAV writer;
+    Mute mute(2, 6);
+    mute.convert(dir / "in.wav", dir / "out.wav", reader, writer);
+
+    struct stat in, out;
+    stat((dir / "in.wav").c_str(), &in);
+    stat((dir / "out.wav").c_str(), &out);
+    EXPECT_EQ(out.st_size, in.st_size);
+    EXPECT_LT(out.st_blocks * 512, in.st_blocks * 512 - 4 * 88200 + 2 * 4096);
+
+    // The hole reads as silence and is reported as one, the rest keeps the tone
+    reader.openWAVFile(dir / "out.wav");
+    reader.parseHead();
+    vector<int16_t> block;
+    u_int64_t pos = 0, holes = 0;
+    while (reader.getSamples(block, 0, 8))
+    {
+        for (size_t i = 0; i < block.size(); ++i)
+        {
+            const bool muted = pos + i >= 2 * 44100 && pos + i < 6 * 44100;
+            ASSERT_EQ(block[i], muted ? 0 : samples[pos + i]);
+        }
+        holes += reader.blockIsHole();
+        pos += block.size();
+    }
+    reader.closeWAVFile();
+    EXPECT_EQ(pos, samples.size());
+    EXPECT_GT(holes, 0u);
+}
+
+TEST(Graph, SplitAndMergeMatchLinearRuns)
+{
+    // Two branches of a shared prefix, one with lookahead, and a merge of them one second late
+    const TestDir dir("graph");
+
+    vector<int16_t> samples(5 * 44100 + 321);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)(12000 * sin(2 * M_PI * 440 * i / 44100) + 6000 * sin(2 * M_PI * 60 * i / 44100));
+
+    writeTestWAV(dir / "in.wav", samples);
+
+    ParseCmdLineArg args(vector<string>{"sound_pr", "-g", "graph.txt", dir / "in.wav"});
+    istringstream text("shared = input | highpass 100 2\n"
+                       "a = shared | limiter -6 5 2 100\n"
+                       "b = shared | lowpass 2000 4\n"
+                       "m = a | mix @b 1\n"
+                       "out a " + (dir / "a.wav").string() + "\n"
+                       "out b " + (dir / "b.wav").string() + "\n"
+                       "out m " + (dir / "m.wav").string() + "\n");
+    {
+        EffectGraph graph;
+        graph.parse(text, args);
+        ReadWAV reader;
+        graph.run(dir / "in.wav", reader, IOMode::Buffered);
+    }
+
+    auto load = [](const fs::path &name)
+    {
+        ifstream fin(name, ios::binary);
+        fin.seekg(sizeof(WAVHeader));
+        vector<int16_t> data(fs::file_size(name) / 2 - sizeof(WAVHeader) / 2);
+        fin.read((char *)data.data(), data.size() * 2);
+        return data;
+    };
+
+    // The same chains one by one
+    auto linear = [&](vector<Converter *> convs, const string &name)
+    {
+        ReadWAV reader;
+        WriteWAV writer;
+        StreamPass pass;
+        for (Converter *conv : convs)
+            pass.add(conv);
+        pass.run(dir / "in.wav", dir / name, reader, writer);
+        for (Converter *conv : convs)
+            delete conv;
+        return load(dir / name);
+    };
+
+    vector<int16_t> a = linear({new Filter("highpass", 100, 0, 0, 2), new Limiter(-6, 5, 2, 100)}, "ra.wav");
+    vector<int16_t> b = linear({new Filter("highpass", 100, 0, 0, 2), new Filter("lowpass", 2000, 0, 0, 4)}, "rb.wav");
+    vector<int16_t> m = load(dir / "m.wav");
+
+    ASSERT_EQ(a.size(), samples.size());
+    EXPECT_EQ(load(dir / "a.wav"), a);
+    EXPECT_EQ(load(dir / "b.wav"), b);
+    ASSERT_EQ(m.size(), samples.size());
+    for (size_t i = 0; i < m.size(); ++i)
+        ASSERT_EQ(m[i], i < 44100 ? a[i] : (int16_t)((a[i] + b[i - 44100]) / 2)) << i;
+}
+
+TEST(Converters, PipelinedPassMatchesSequentialPass)
+{
+    // Stage threads with one block between them must write what a single thread writes
+    const TestDir dir("pipe");
+
+    vector<int16_t> samples(7 * 44100 + 99);
+    u_int32_t seed = 7;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        samples[i] = (int16_t)(20000 * sin(2 * M_PI * 330 * i / 44100) + (int)(seed >> 22) - 512);
+    }
+
+    writeTestWAV(dir / "in.wav", samples);
+
+    vector<string> contents;
+    for (size_t threads : {0, 1, 2, 5})
+    {
+        vector<Converter *> chain{new Filter("highpass", 120, 0, 0, 4), new Reverberation(1, 5, 0.4),
+                                  new Limiter(-3, 5, 2, 100), new Mute(2, 3), new Filter("lowpass", 5000, 0, 0, 2)};
+        ReadWAV reader;
+        WriteWAV writer;
+        StreamPass pass;
+        for (Converter *conv : chain)
+            pass.add(conv);
+        pass.setPipeline(PipelineConfig{threads, 1, false});
+        pass.run(dir / "in.wav", dir / "out.wav", reader, writer);
+        for (Converter *conv : chain)
+            delete conv;
+
+        ifstream fin(dir / "out.wav", ios::binary);
+        contents.emplace_back(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    }
+
+    ASSERT_EQ(contents[0].size(), sizeof(WAVHeader) + samples.size() * 2);
+    for (size_t i = 1; i < contents.size(); ++i)
+        EXPECT_EQ(contents[i], contents[0]) << i;
+}
+
+TEST(Converters, SilenceSkippingMatchesKernels)
+{
+    // A tone, a long silence and the tone again, in blocks of one second
+    vector<int16_t> samples(12 * 44100, 0);
+    for (size_t i = 0; i < samples.size(); ++i)
+        if (i < 44100 || i >= 10 * 44100)
+            samples[i] = (int16_t)(10000 * sin(2 * M_PI * 440 * i / 44100));
+
+    auto makeChain = []()
+    {
+        return vector<Converter *>{new Filter("highpass", 80, 0, 0, 4), new Reverberation(0, 12, 0.3),
+                                   new Mute(0, 1), new Filter("peaking", 3000, 4, 1.2, 2)};
+    };
+    vector<Converter *> full = makeChain(), skipping = makeChain();
+
+    for (size_t c = 0; c < full.size(); ++c)
+    {
+        full[c]->prepare(44100);
+        skipping[c]->prepare(44100);
+
+        size_t skipped = 0;
+        vector<int16_t> next;
+        for (size_t pos = 0; pos < samples.size(); pos += 44100)
+        {
+            vector<int16_t> a(samples.begin() + pos, samples.begin() + pos + 44100), b = a;
+            full[c]->processBlock(a, pos);
+            if (isSilent(b) && skipping[c]->processSilence(pos, b.size()))
+                ++skipped;
+            else
+                skipping[c]->processBlock(b, pos);
+
+            ASSERT_EQ(a, b) << skipping[c]->describe() << " at " << pos;
+            next.insert(next.end(), a.begin(), a.end());
+        }
+
+        // Every one of them has come to rest somewhere in the eight silent seconds
+        EXPECT_GT(skipped, 0u) << skipping[c]->describe();
+        samples = next;
+        delete full[c];
+        delete skipping[c];
+    }
+}
+
+TEST(Timeline, SweepMatchesEveryCommandOnEveryBlock)
+{
+    // The index finds what a scan of every interval finds
+    IntervalIndex index;
+    vector<pair<u_int64_t, u_int64_t>> intervals;
+    u_int32_t seed = 3;
+    for (size_t i = 0; i < 200; ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        u_int64_t begin = seed % 10000, end = begin + (seed >> 20) % 300;
+        intervals.push_back({begin, end});
+        index.add(begin, end, i);
+    }
+    index.build();
+    vector<size_t> found;
+    for (u_int64_t pos = 0; pos < 10500; pos += 37)
+    {
+        vector<size_t> expected;
+        for (size_t i = 0; i < intervals.size(); ++i)
+            if (intervals[i].first < pos + 50 && pos < intervals[i].second)
+                expected.push_back(i);
+        index.overlapping(pos, pos + 50, found);
+        ASSERT_EQ(found, expected) << pos;
+
+        u_int64_t next = numeric_limits<u_int64_t>::max();
+        for (auto [begin, end] : intervals)
+            if (begin < end && end > pos)
+                next = min(next, max(begin, pos));
+        ASSERT_EQ(index.nextCovered(pos), next) << pos;
+    }
+
+    // Many short edits in one pass, with and without a latency in front of them, against
+    // every kernel run over every block of the whole file
+    const TestDir dir("timeline");
+
+    vector<int16_t> samples(40 * 44100 + 321), aux(3 * 44100);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)(12000 * sin(2 * M_PI * 220 * i / 44100));
+    for (size_t i = 0; i < aux.size(); ++i)
+        aux[i] = (int16_t)(9000 * sin(2 * M_PI * 700 * i / 44100));
+    writeTestWAV(dir / "in.wav", samples);
+    writeTestWAV(dir / "aux.wav", aux);
+
+    for (bool latency : {false, true})
+    {
+        auto makeChain = [&]()
+        {
+            vector<Converter *> chain;
+            if (latency)
+                chain.push_back(new Limiter(-6, 5, 2, 100));
+            for (u_int32_t t = 2; t < 38; t += 3)
+            {
+                chain.push_back(new Mute(t, t + 1));
+                chain.push_back(new Reverberation(t + 1, t + 2, 0.3));
+            }
+            chain.push_back(new Mix(dir / "aux.wav", 20));
+            return chain;
+        };
+
+        vector<Converter *> chain = makeChain();
+        ReadWAV reader;
+        WriteWAV writer;
+        StreamPass pass;
+        for (Converter *conv : chain)
+            pass.add(conv);
+        pass.run(dir / "in.wav", dir / "out.wav", reader, writer);
+        for (Converter *conv : chain)
+            delete conv;
+
+        vector<int16_t> expected = samples;
+        for (Converter *conv : makeChain())
+        {
+            conv->prepare(44100);
+            vector<int16_t> next, block;
+            for (size_t pos = 0; pos < expected.size(); pos += 44100)
+            {
+                block.assign(expected.begin() + pos, expected.begin() + min(pos + 44100, expected.size()));
+                conv->processBlock(block, pos);
+                next.insert(next.end(), block.begin(), block.end());
+            }
+            conv->flush(block);
+            next.insert(next.end(), block.begin(), block.end());
+            expected = next;
+            delete conv;
+        }
+
+        ifstream fin(dir / "out.wav", ios::binary);
+        string content(istreambuf_iterator<char>(fin), {});
+        ASSERT_EQ(content.size(), sizeof(WAVHeader) + expected.size() * 2);
+        EXPECT_EQ(content.substr(sizeof(WAVHeader)), string((const char *)expected.data(), expected.size() * 2))
+            << latency;
+    }
+}
+
+TEST(CApi, BuffersMatchThePassOverFiles)
+{
+    // The config of a file run on buffers given in pieces of odd sizes, in place
+    const TestDir dir("capi");
+
+    vector<int16_t> samples(9 * 44100 + 555), aux(2 * 44100);
+    u_int32_t seed = 11;
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        seed = seed * 1664525 + 1013904223;
+        samples[i] = i < 4 * 44100 || i >= 6 * 44100 ? (int16_t)(9000 * sin(2 * M_PI * 300 * i / 44100) + (int)(seed >> 24) - 128) : 0;
+    }
+    for (size_t i = 0; i < aux.size(); ++i)
+        aux[i] = (int16_t)(7000 * sin(2 * M_PI * 500 * i / 44100));
+
+    const char *config = "highpass 80 4\nmute 1 2\nmix $1 3\nreverberation 2 7 0.3\nlimiter -3 5 2 100\n";
+    sp_source source{aux.data(), aux.size()};
+    char error[256];
+    sp_pipeline *pipeline = sp_create(config, 44100, &source, 1, error, sizeof(error));
+    ASSERT_NE(pipeline, nullptr) << error;
+    EXPECT_GE(sp_latency(pipeline), 5u * 44100 / 1000);
+
+    vector<int16_t> buffer = samples, result;
+    size_t produced = 0;
+    for (size_t first = 0, size = 1000; first < buffer.size(); first += size, size = size * 3 % 70001 + 1)
+    {
+        size = min(size, buffer.size() - first);
+        ASSERT_EQ(sp_process(pipeline, buffer.data() + first, size, buffer.data() + first, &produced), 0)
+            << sp_last_error(pipeline);
+        result.insert(result.end(), buffer.begin() + first, buffer.begin() + first + produced);
+    }
+    vector<int16_t> held(sp_latency(pipeline));
+    EXPECT_NE(sp_flush(pipeline, held.data(), held.size() - 1, &produced), 0);
+    ASSERT_EQ(sp_flush(pipeline, held.data(), held.size(), &produced), 0) << sp_last_error(pipeline);
+    result.insert(result.end(), held.begin(), held.begin() + produced);
+
+    sp_stats stats;
+    ASSERT_EQ(sp_get_stats(pipeline, &stats), 0);
+    EXPECT_EQ(stats.samples_in, samples.size());
+    EXPECT_EQ(stats.samples_out, samples.size());
+    EXPECT_GT(stats.silent_blocks, 0u);
+    EXPECT_NE(sp_process(pipeline, buffer.data(), 1, buffer.data(), &produced), 0);
+    sp_destroy(pipeline);
+
+    // The same commands over files
+    writeTestWAV(dir / "in.wav", samples);
+    writeTestWAV(dir / "aux.wav", aux);
+    ParseCmdLineArg args(vector<string>{"sound_pr", "-c", "config.txt", dir / "out.wav", dir / "in.wav", dir / "aux.wav"});
+    istringstream text(config);
+    queue<Converter *> parsed = ParseConfigFile(string()).parsing(text, args);
+    vector<Converter *> chain;
+    StreamPass pass;
+    for (; !parsed.empty(); parsed.pop())
+    {
+        chain.push_back(parsed.front());
+        pass.add(chain.back());
+    }
+    ReadWAV reader;
+    WriteWAV writer;
+    pass.run(dir / "in.wav", dir / "out.wav", reader, writer);
+    for (Converter *conv : chain)
+        delete conv;
+
+    ifstream fin(dir / "out.wav", ios::binary);
+    string content(istreambuf_iterator<char>(fin), {});
+    EXPECT_EQ(content.substr(sizeof(WAVHeader)), string((const char *)result.data(), result.size() * 2));
+
+    // Commands that need files or the whole input are turned down with a reason
+    for (const char *bad : {"mix $2 0", "mix $0 0", "denoise 0 1 18", "mute 5 1"})
+    {
+        EXPECT_EQ(sp_create(bad, 44100, &source, 1, error, sizeof(error)), nullptr) << bad;
+        EXPECT_GT(strlen(error), 0u) << bad;
+    }
+}
+
+TEST(WAVFiles, OtherRatesAreConvertedOnRead)
+{
+    const TestDir dir("rates");
+
+    // A 1 kHz tone at 48 kHz and a constant at 22.05 kHz to mix in
+    vector<int16_t> tone(6 * 48000 + 77);
+    for (size_t i = 0; i < tone.size(); ++i)
+        tone[i] = (int16_t)lrint(10000 * sin(2 * M_PI * 1000 * i / 48000));
+    writeTestWAV(dir / "in.wav", tone, 48000);
+    writeTestWAV(dir / "src.wav", vector<int16_t>(3 * 22050, 2000), 22050);
+
+    ReadWAV reader;
+    reader.openWAVFile(dir / "in.wav");
+    reader.parseHead();
+    reader.checkCorrect();
+    ASSERT_TRUE(reader.isConverted());
+    EXPECT_EQ(reader.getSampleRate(), pipelineRate);
+    const u_int64_t count = (tone.size() * 147 + 159) / 160;
+    ASSERT_EQ(reader.getSampleCount(), count);
+
+    // Away from the ends the tone comes out at the new rate as it was
+    vector<int16_t> whole, block;
+    while (reader.getSamples(block, 0, reader.getSizeFile()))
+        whole.insert(whole.end(), block.begin(), block.end());
+    ASSERT_EQ(whole.size(), count);
+    for (size_t n = 1000; n < count - 1000; ++n)
+        ASSERT_NEAR(whole[n], 10000 * sin(2 * M_PI * 1000 * n / 44100.0), 4) << n;
+
+    // A read from the middle starts the converter over and gives the same samples
+    reader.seekSample(2 * 44100 + 500, count);
+    ASSERT_TRUE(reader.getSamples(block, 0, reader.getSizeFile()));
+    EXPECT_TRUE(equal(block.begin(), block.end(), whole.begin() + 2 * 44100 + 500));
+    reader.closeWAVFile();
+
+    // A pass writes at the pipeline rate and the source is converted as it is mixed in
+    Mute mute(1, 2);
+    Mix mix((dir / "src.wav").string(), 3);
+    StreamPass pass;
+    pass.add(&mute);
+    pass.add(&mix);
+    WriteWAV writer;
+    pass.run(dir / "in.wav", dir / "out.wav", reader, writer);
+
+    reader.openWAVFile(dir / "out.wav");
+    reader.parseHead();
+    reader.checkCorrect();
+    EXPECT_FALSE(reader.isConverted());
+    vector<int16_t> out;
+    while (reader.getSamples(block, 0, reader.getSizeFile()))
+        out.insert(out.end(), block.begin(), block.end());
+    reader.closeWAVFile();
+
+    ASSERT_EQ(out.size(), count);
+    EXPECT_TRUE(equal(out.begin(), out.begin() + 44100, whole.begin()));
+    EXPECT_TRUE(all_of(out.begin() + 44100, out.begin() + 2 * 44100, [](int16_t s) { return s == 0; }));
+    for (size_t n = 3 * 44100 + 1000; n < 5 * 44100; ++n)
+        ASSERT_NEAR(out[n], (whole[n] + 2000) / 2, 1) << n;
+}
+
+TEST(Memory, BudgetAdmitsJobsAndPassesShrinkTheirBlocks)
+{
+    MemoryBudget &budget = MemoryBudget::global();
+    budget.setLimit(4 << 20);
+    const u_int64_t base = budget.getUsed();
+
+    // A second job waits until the first gives back enough, a single job always goes in
+    {
+        MemoryLease first;
+        ASSERT_TRUE(first.admit(3 << 20));
+        EXPECT_EQ(budget.getUsed(), base + (3 << 20));
+
+        atomic<bool> admitted{false};
+        thread second([&]()
+                      {
+                          MemoryLease lease;
+                          admitted = lease.admit(2 << 20);
+                      });
+        this_thread::sleep_for(chrono::milliseconds(200));
+        EXPECT_FALSE(admitted.load());
+        EXPECT_EQ(budget.getWaiting(), 1u);
+
+        first.resize(1 << 20);
+        second.join();
+        EXPECT_TRUE(admitted.load());
+        EXPECT_GE(budget.getPeak(), base + (3 << 20));
+
+        // A cancelled job stops waiting
+        MemoryLease third;
+        atomic<bool> cancelled{true};
+        first.resize(4 << 20);
+        EXPECT_FALSE(third.admit(1 << 20, &cancelled));
+    }
+    EXPECT_EQ(budget.getUsed(), base);
+
+    // The same pass with a tight budget runs on smaller blocks and writes the same samples
+    const TestDir dir("memory");
+    vector<int16_t> samples(10 * 44100 + 321);
+    for (size_t i = 0; i < samples.size(); ++i)
+        samples[i] = (int16_t)(12000 * sin(2 * M_PI * 440 * i / 44100) * (i % 30000 < 20000));
+    writeTestWAV(dir / "in.wav", samples);
+
+    vector<string> contents;
+    vector<int> units;
+    for (u_int64_t limit : {(u_int64_t)0, (u_int64_t)64 << 10})
+    {
+        budget.setLimit(limit);
+        Filter filter("highpass", 80, 0, 0, 4);
+        Reverberation reverb(2, 8, 0.3);
+        Mute mute(4, 5);
+        Limiter limiter(-3, 5, 2, 100);
+        StreamPass pass;
+        for (Converter *conv : vector<Converter *>{&filter, &reverb, &mute, &limiter})
+            pass.add(conv);
+
+        ReadWAV reader;
+        WriteWAV writer;
+        MemoryLease lease;
+        pass.setMemory(&lease);
+        pass.run(dir / "in.wav", dir / "out.wav", reader, writer);
+        units.push_back(reader.getUnitSize());
+        EXPECT_GE(lease.size(), reverb.memoryUse(44100, 0) + (u_int64_t)reader.getUnitSize() * sizeof(int16_t));
+
+        ifstream fin(dir / "out.wav", ios::binary);
+        contents.emplace_back(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    }
+    budget.setLimit(0);
+
+    EXPECT_EQ(units[0], 44100);
+    EXPECT_LT(units[1], 44100);
+    EXPECT_GE(units[1], (int)StreamPass::minBlock);
+    EXPECT_EQ(contents[1], contents[0]);
+}
+
+TEST(StageCache, KeysLookupAndEviction)
+{
+    const TestDir dir("cache");
+    auto writeFile = [](fs::path name, size_t size, char fill)
+    {
+        ofstream fout(name, ios::binary);
+        fout << string(size, fill);
+    };
+    auto readFile = [](fs::path name)
+    {
+        ifstream fin(name, ios::binary);
+        return string(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+    };
+    writeFile(dir / "in.wav", 1000, 'i');
+
+    // The keys chain the input with every command, a change anywhere gives new ones
+    StageCache cache(dir / "cache", 2500, true);
+    const string root = cache.rootKey(dir / "in.wav", ResampleQuality::Medium);
+    EXPECT_EQ(cache.rootKey(dir / "in.wav", ResampleQuality::Medium), root);
+    EXPECT_NE(cache.rootKey(dir / "in.wav", ResampleQuality::Best), root);
+    Mute mute(1, 2), same(1, 2), other(1, 3);
+    const string key = cache.nextKey(root, &mute);
+    EXPECT_EQ(cache.nextKey(root, &same), key);
+    EXPECT_NE(cache.nextKey(root, &other), key);
+    EXPECT_NE(key, root);
+
+    fs::last_write_time(dir / "in.wav", fs::last_write_time(dir / "in.wav") + chrono::seconds(10));
+    EXPECT_NE(cache.rootKey(dir / "in.wav", ResampleQuality::Medium), root);
+
+    // A miss, then the stored output comes back
+    EXPECT_FALSE(cache.lookup(key, dir / "out.wav"));
+    writeFile(dir / "a.wav", 1000, 'a');
+    cache.store(key, dir / "a.wav");
+    ASSERT_TRUE(cache.lookup(key, dir / "out.wav"));
+    EXPECT_EQ(readFile(dir / "out.wav"), readFile(dir / "a.wav"));
+
+    // A disabled cache neither finds nor stores anything
+    StageCache disabled(dir / "cache", 2500, false);
+    EXPECT_FALSE(disabled.lookup(key, dir / "out.wav"));
+    disabled.store("0000000000000000", dir / "a.wav");
+    EXPECT_FALSE(fs::exists(dir / "cache" / "0000000000000000.wav"));
+
+    // Over the size limit the least recently used entry goes, a hit counts as a use
+    writeFile(dir / "b.wav", 1000, 'b');
+    writeFile(dir / "c.wav", 1000, 'c');
+    cache.store("b", dir / "b.wav");
+    const auto now = fs::file_time_type::clock::now();
+    fs::last_write_time(dir / "cache" / (key + ".wav"), now - chrono::seconds(100));
+    fs::last_write_time(dir / "cache" / "b.wav", now - chrono::seconds(50));
+    EXPECT_TRUE(cache.lookup(key, dir / "out.wav"));
+    cache.store("c", dir / "c.wav");
+
+    EXPECT_TRUE(fs::exists(dir / "cache" / (key + ".wav")));
+    EXPECT_FALSE(fs::exists(dir / "cache" / "b.wav"));
+    EXPECT_TRUE(fs::exists(dir / "cache" / "c.wav"));
+}
+
+TEST(Daemon, SubmitCancelAndStatsOverTheSocket)
+{
+    const TestDir dir("daemon");
+    writeTestWAV(dir / "in.wav", vector<int16_t>(3 * 44100, 1000));
+    writeTestWAV(dir / "src.wav", vector<int16_t>(2 * 44100, 3000));
+
+    // Decoded $n files are shared between jobs, the least recently used go over the size
+    {
+        AuxCache cache(3 * 44100 * 2);
+        auto first = cache.get(dir / "in.wav", ResampleQuality::Medium);
+        EXPECT_EQ(cache.get(dir / "in.wav", ResampleQuality::Medium), first);
+        cache.get(dir / "src.wav", ResampleQuality::Medium);
+        EXPECT_NE(cache.get(dir / "in.wav", ResampleQuality::Medium), first);
+
+        // Jobs with another preset get a file of their own
+        AuxCache presets(1 << 20);
+        EXPECT_NE(presets.get(dir / "in.wav", ResampleQuality::Fast),
+                  presets.get(dir / "in.wav", ResampleQuality::Medium));
+    }
+
+    const string socketName = dir / "sp.sock";
+    Server server(socketName, 2, 16 << 20);
+    thread serving([&]() { server.serve(); });
+    for (int i = 0; i < 200 && !fs::exists(socketName); ++i)
+        this_thread::sleep_for(chrono::milliseconds(10));
+
+    auto job = [&](string out)
+    {
+        return Server::request(socketName, "JOB\nout " + (dir / out).string() + "\nin " + (dir / "in.wav").string() +
+                                               "\naux " + (dir / "src.wav").string() +
+                                               "\nopt --no-cache\nconfig\nmute 0 1\nmix $1 1\n");
+    };
+
+    // A job runs, writes its output and leaves nothing else next to it
+    const string reply = job("out.wav");
+    EXPECT_EQ(reply.rfind("QUEUED 1\nDONE 1 ", 0), 0u) << reply;
+    ReadWAV reader;
+    reader.openWAVFile(dir / "out.wav");
+    reader.parseHead();
+    vector<int16_t> out, block;
+    while (reader.getSamples(block, 0, reader.getSizeFile()))
+        out.insert(out.end(), block.begin(), block.end());
+    reader.closeWAVFile();
+    ASSERT_EQ(out.size(), 3u * 44100);
+    EXPECT_EQ(out[100], 0);
+    EXPECT_EQ(out[44100 + 100], 2000);
+    EXPECT_EQ(out[2 * 44100 + 100], 2000);
+    for (const auto &entry : fs::directory_iterator(dir))
+        EXPECT_EQ(entry.path().filename().string().rfind(".sound_pr", 0), string::npos) << entry.path();
+    EXPECT_FALSE(fs::exists(dir / "out.wav.resume"));
+
+    // Options of the daemon itself and paths relative to the client are turned down before queueing
+    const string files = "out " + (dir / "other.wav").string() + "\nin " + (dir / "in.wav").string() + "\n";
+    for (const string &fields : {files + "opt --mem-limit=1\n",
+                                 files + "opt --serve=x.sock\n",
+                                 files + "opt --cache-dir=cache\n",
+                                 "out other.wav\nin " + (dir / "in.wav").string() + "\n"})
+        EXPECT_EQ(Server::request(socketName, "JOB\n" + fields + "config\nmute 0 1\n").rfind("FAILED ", 0), 0u)
+            << fields;
+
+    // A job held at admission by memory the test keeps is cancelled while it waits
+    MemoryBudget &budget = MemoryBudget::global();
+    budget.setLimit(1 << 20);
+    string cancelled;
+    {
+        MemoryLease held;
+        ASSERT_TRUE(held.admit(1 << 20));
+        thread waiting([&]() { cancelled = job("cancelled.wav"); });
+        for (int i = 0; i < 500 && budget.getWaiting() == 0; ++i)
+            this_thread::sleep_for(chrono::milliseconds(10));
+
+        const string stats = Server::request(socketName, "STATS\n");
+        EXPECT_NE(stats.find("completed=1 "), string::npos) << stats;
+        EXPECT_NE(stats.find("running=1 "), string::npos) << stats;
+        EXPECT_NE(stats.find("mem_waiting=1"), string::npos) << stats;
+
+        EXPECT_EQ(Server::request(socketName, "CANCEL 2\n"), "OK 2\n");
+        EXPECT_EQ(Server::request(socketName, "CANCEL 9\n"), "UNKNOWN 9\n");
+        waiting.join();
+    }
+    budget.setLimit(0);
+    EXPECT_EQ(cancelled.rfind("QUEUED 2\nCANCELLED 2 ", 0), 0u) << cancelled;
+    EXPECT_FALSE(fs::exists(dir / "cancelled.wav"));
+    EXPECT_NE(Server::request(socketName, "STATS\n").find("cancelled=1 "), string::npos);
+
+    server.stop();
+    serving.join();
+    EXPECT_FALSE(fs::exists(socketName));
+}
+
+TEST(StageCache, FusedRunsStoreTheirLastStage)
+{
+    const TestDir dir("fused");
+    vector<int16_t> samples(3 * 44100, 2000);
+    writeTestWAV(dir / "in.wav", samples);
+
+    // Two mutes share a pass, the denoiser analyzes its input and starts the next one
+    auto stages = []()
+    {
+        return vector<Converter *>{new Mute(0, 1), new Mute(1, 2), new Denoise(0, 2, 18.0)};
+    };
+    auto render = [&](string cacheDir, bool fuse)
+    {
+        vector<string> argList{"sound_pr", "-c", "config.txt", "--cache-dir=" + cacheDir, "--no-incremental",
+                               dir / "out.wav", dir / "in.wav"};
+        if (!fuse)
+            argList.push_back("--no-fuse");
+        ParseCmdLineArg args(argList);
+        queue<Converter *> convs;
+        for (Converter *conv : stages())
+            convs.push(conv);
+        Job(args, convs).run();
+    };
+    auto stored = [&](string cacheDir)
+    {
+        StageCache cache(cacheDir, 1 << 30, true);
+        vector<Converter *> convs = stages();
+        vector<bool> found;
+        string key = cache.rootKey(dir / "in.wav", ResampleQuality::Medium);
+        for (Converter *conv : convs)
+        {
+            key = cache.nextKey(key, conv);
+            found.push_back(fs::exists(fs::path(cacheDir) / (key + ".wav")));
+            delete conv;
+        }
+        return found;
+    };
+
+    // A change to the denoiser reuses both mutes, a change to the second mute starts over
+    render(dir / "fused", true);
+    EXPECT_EQ(stored(dir / "fused"), (vector<bool>{false, true, true}));
+    render(dir / "split", false);
+    EXPECT_EQ(stored(dir / "split"), (vector<bool>{true, true, true}));
+}